@@ -0,0 +1,343 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "htable.h"
+
+
+#define BENCH_KEYS 4096
+#define BENCH_OPS 200000
+#define BENCH_LOOKUP_KEYS (1 << 20)
+#define BENCH_LOOKUPS 20000000
+
+char *keys[BENCH_KEYS];
+char *lookup_keys[BENCH_LOOKUP_KEYS];
+
+typedef struct bench_args
+{
+  htable *tab;
+  int async;
+  unsigned int seed;
+} bench_args;
+
+void init_keys(char **dst, int n)
+{
+  for (int i = 0; i < n; i++) {
+    dst[i] = malloc(16);
+    snprintf(dst[i], 16, "key %i", i);
+  }
+}
+
+void free_keys(char **dst, int n)
+{
+  for (int i = 0; i < n; i++) {
+    free(dst[i]);
+  }
+}
+
+double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+void *write_table(void *arg)
+{
+  bench_args *args = arg;
+
+  // Three sets for every remove, so the table stays populated
+  for (int n = 0; n < BENCH_OPS; n++) {
+    int i = rand_r(&args->seed) % BENCH_KEYS;
+
+    if (n % 4 == 3) {
+      if (args->async) {
+        htable_remove_async(args->tab, keys[i]);
+      } else {
+        htable_remove(args->tab, keys[i]);
+      }
+    } else {
+      if (args->async) {
+        htable_set_async(args->tab, keys[i], keys[i]);
+      } else {
+        htable_set(args->tab, keys[i], keys[i]);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+// Run 'threads' writers against a fresh table and return the throughput in operations per second
+double bench_writers(int threads, int async)
+{
+  htable *tab = htable_create(BENCH_KEYS);
+  pthread_t tids[threads];
+  bench_args args[threads];
+
+  double start = now();
+
+  for (int t = 0; t < threads; t++) {
+    args[t] = (bench_args) {tab, async, (unsigned int) t + 1};
+    pthread_create(&tids[t], NULL, write_table, &args[t]);
+  }
+
+  for (int t = 0; t < threads; t++) {
+    pthread_join(tids[t], NULL);
+  }
+
+  // Queued operations only count once they're applied
+  htable_flush(tab);
+
+  double elapsed = now() - start;
+
+  htable_destroy(tab);
+
+  return (double) threads * BENCH_OPS / elapsed;
+}
+
+// Single threaded lookups of random keys on a table sized to its contents, too large to stay in cache.
+// Returns nanoseconds per lookup
+double bench_lookups(unsigned int flags)
+{
+  htable *tab = htable_create_with_flags(BENCH_LOOKUP_KEYS, flags);
+  unsigned int seed = 1;
+  size_t found = 0;
+
+  for (int i = 0; i < BENCH_LOOKUP_KEYS; i++) {
+    htable_set(tab, lookup_keys[i], lookup_keys[i]);
+  }
+
+  double start = now();
+
+  for (int n = 0; n < BENCH_LOOKUPS; n++) {
+    found += htable_get(tab, lookup_keys[rand_r(&seed) % BENCH_LOOKUP_KEYS]) != NULL;
+  }
+
+  double elapsed = now() - start;
+
+  htable_destroy(tab);
+
+  return found == BENCH_LOOKUPS ? elapsed / BENCH_LOOKUPS * 1e9 : -1;
+}
+
+// Merge a delta holding every fourth key into a live table holding the rest. Returns milliseconds taken
+double bench_merge(int threads)
+{
+  htable *live = htable_create(BENCH_LOOKUP_KEYS);
+  htable *delta = htable_create(BENCH_LOOKUP_KEYS);
+
+  for (int i = 0; i < BENCH_LOOKUP_KEYS; i++) {
+    htable_set(i % 4 == 0 ? delta : live, lookup_keys[i], lookup_keys[i]);
+  }
+
+  double start = now();
+
+  if (threads == 0) {
+
+    // What callers did before htable_merge
+    htable_itr itr = htable_iterator(delta);
+    htable_entry *entry = NULL;
+
+    while ((entry = htable_iterator_next(&itr)) != NULL) {
+      htable_set(live, entry->key, entry->val);
+    }
+
+    htable_iterator_destroy(&itr);
+
+  } else {
+
+    htable_merge(live, delta, NULL, threads);
+
+  }
+
+  double elapsed = now() - start;
+
+  htable_destroy(live);
+  htable_destroy(delta);
+
+  return elapsed * 1e3;
+}
+
+// Sets on one thread with and without a mutation log written to /dev/null. Returns nanoseconds per set
+double bench_log(int logged)
+{
+  htable *tab = htable_create(BENCH_LOOKUP_KEYS);
+  int fd = open("/dev/null", O_WRONLY);
+
+  // Records are dropped rather than waited for, so the ring holds every record of the run
+  if (logged) {
+    htable_log_start(tab, fd, 1 << 25, NULL);
+  }
+
+  double start = now();
+
+  for (int i = 0; i < BENCH_LOOKUP_KEYS; i++) {
+    htable_set(tab, lookup_keys[i], lookup_keys[i]);
+  }
+
+  double elapsed = now() - start;
+
+  if (logged && htable_log_stop(tab) != 0) {
+    fprintf(stderr, "log: %s\n", strerror(errno));
+  }
+
+  htable_destroy(tab);
+  close(fd);
+
+  return elapsed / BENCH_LOOKUP_KEYS * 1e9;
+}
+
+// Skewed lookups, 95% of them on 256 hot keys. Returns nanoseconds per lookup and fills 'hit_rate'
+double bench_cache(unsigned int flags, double *hit_rate)
+{
+  htable *tab = htable_create_with_flags(BENCH_LOOKUP_KEYS, flags);
+  htable_cache_stats before, after;
+  unsigned int seed = 1;
+  size_t found = 0;
+
+  for (int i = 0; i < BENCH_LOOKUP_KEYS; i++) {
+    htable_set(tab, lookup_keys[i], lookup_keys[i]);
+  }
+
+  before = htable_thread_cache_stats();
+  double start = now();
+
+  for (int n = 0; n < BENCH_LOOKUPS; n++) {
+    int r = rand_r(&seed);
+    int i = r % 20 == 0 ? r % BENCH_LOOKUP_KEYS : (r / 20) % 256 * 4099 % BENCH_LOOKUP_KEYS;
+
+    found += htable_get(tab, lookup_keys[i]) != NULL;
+  }
+
+  double elapsed = now() - start;
+  after = htable_thread_cache_stats();
+
+  uint64_t hits = after.hits - before.hits;
+  uint64_t misses = after.misses - before.misses;
+  *hit_rate = hits + misses == 0 ? 0 : (double) hits / (double) (hits + misses);
+
+  htable_destroy(tab);
+
+  return found == BENCH_LOOKUPS ? elapsed / BENCH_LOOKUPS * 1e9 : -1;
+}
+
+// Nanoseconds per entry to iterate the whole table
+double bench_iterate(htable *tab)
+{
+  size_t found = 0;
+  double start = now();
+
+  for (int pass = 0; pass < 10; pass++) {
+    htable_itr itr = htable_iterator(tab);
+
+    while (htable_iterator_next(&itr) != NULL) {
+      found++;
+    }
+
+    htable_iterator_destroy(&itr);
+  }
+
+  return (now() - start) / (double) found * 1e9;
+}
+
+// Delete 15 of every 16 entries, then compact 'budget' steps at a time
+void bench_compact(size_t budget)
+{
+  htable *tab = htable_create(BENCH_LOOKUP_KEYS);
+  double longest = 0;
+  int calls = 0;
+
+  for (int i = 0; i < BENCH_LOOKUP_KEYS; i++) {
+    htable_set(tab, lookup_keys[i], lookup_keys[i]);
+  }
+
+  for (int i = 0; i < BENCH_LOOKUP_KEYS; i++) {
+    if (i % 16 != 0) {
+      htable_remove(tab, lookup_keys[i]);
+    }
+  }
+
+  size_t memory = htable_memory(tab);
+  double iterate = bench_iterate(tab);
+
+  for (int more = 1; more; calls++) {
+    double start = now();
+
+    more = htable_compact(tab, budget);
+
+    if (now() - start > longest) {
+      longest = now() - start;
+    }
+  }
+
+  printf("\ncompacting %i of %i entries, %zu per step\n", htable_size(tab), BENCH_LOOKUP_KEYS, budget);
+  printf("                           before      after\n");
+  printf("bytes                  %10zu %10zu\n", memory, htable_memory(tab));
+  printf("iteration ns/entry     %10.1f %10.1f\n", iterate, bench_iterate(tab));
+  printf("%i calls, longest %.1f us including allocation outside the lock\n", calls, longest * 1e6);
+
+  // A compact table only written a little since isn't copied again
+  htable_set(tab, lookup_keys[0], lookup_keys[0]);
+
+  double start = now();
+
+  while (htable_compact(tab, budget));
+
+  printf("compacting again after one write: %.1f us\n", (now() - start) * 1e6);
+
+  htable_destroy(tab);
+}
+
+
+int main()
+{
+  int threads[] = {8, 16, 32};
+
+  init_keys(keys, BENCH_KEYS);
+  init_keys(lookup_keys, BENCH_LOOKUP_KEYS);
+
+  printf("writers  direct ops/s  async ops/s\n");
+
+  for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+    double direct = bench_writers(threads[i], 0);
+    double async = bench_writers(threads[i], 1);
+
+    printf("%7i  %12.0f  %11.0f\n", threads[i], direct, async);
+  }
+
+  printf("\nlayout                ns/lookup\n");
+  printf("chained               %9.1f\n", bench_lookups(0));
+  printf("inline                %9.1f\n", bench_lookups(HTABLE_INLINE_BUCKETS));
+  printf("chained, optimistic   %9.1f\n", bench_lookups(HTABLE_OPTIMISTIC));
+  printf("inline, optimistic    %9.1f\n", bench_lookups(HTABLE_INLINE_BUCKETS | HTABLE_OPTIMISTIC));
+
+  printf("\nmerging %i entries     ms\n", BENCH_LOOKUP_KEYS / 4);
+  printf("htable_set per entry    %9.1f\n", bench_merge(0));
+  printf("htable_merge, 1 thread  %9.1f\n", bench_merge(1));
+  printf("htable_merge, 4 threads %9.1f\n", bench_merge(4));
+
+  printf("\nmutation log            ns/set\n");
+  printf("off                     %9.1f\n", bench_log(0));
+  printf("on                      %9.1f\n", bench_log(1));
+
+  double hit_rate = 0;
+  double uncached = bench_cache(0, &hit_rate);
+  double cached = bench_cache(HTABLE_THREAD_CACHE, &hit_rate);
+
+  printf("\nskewed lookups          ns/lookup  hit rate\n");
+  printf("no cache                %9.1f\n", uncached);
+  printf("thread cache            %9.1f  %7.1f%%\n", cached, hit_rate * 100);
+
+  bench_compact(4096);
+
+  free_keys(keys, BENCH_KEYS);
+  free_keys(lookup_keys, BENCH_LOOKUP_KEYS);
+
+  return 0;
+}
@@ -5,6 +5,28 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+// Fields read by optimistic readers are always stored through htable_store, so a reader racing
+// a writer sees either the old or the new pointer, never a torn one. htable_load is the reader side.
+#define htable_load(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define htable_store(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+// Phases of htable_compact()
+#define HTABLE_COMPACT_IDLE 0
+#define HTABLE_COMPACT_FOLD 1
+#define HTABLE_COMPACT_ARENA 2
+#define HTABLE_COMPACT_RELOCATE 3
+
+// Lookup cache of each thread, shared by all tables created with HTABLE_THREAD_CACHE. Entries are
+// tagged with the table's id, which is never reused
+static __thread htable_cache_entry htable_cache[HTABLE_CACHE_SLOTS];
+static __thread htable_cache_stats htable_cache_counters;
+static uint64_t htable_next_id = 1;
 
 // helpers
 
@@ -20,250 +42,2354 @@ static uint64_t hash_fn(const char *key)
   return hash;
 }
 
-static htable_node *htable_node_create(htable *self, const char *key, void *val)
+static size_t htable_index(uint64_t hash, size_t cap)
+{
+  return (size_t) (hash & (cap - 1));
+}
+
+// Index of the bucket holding 'hash' while htable_compact() may be folding the array. Buckets below
+// 'compact_next' have already been folded into the first 'compact_cap', the others still index at 'cap'
+static size_t htable_fold_index(uint64_t hash, size_t cap, size_t compact_cap, size_t compact_next)
+{
+  size_t index = htable_index(hash, cap);
+
+  return index < compact_next ? htable_index(hash, compact_cap) : index;
+}
+
+// Index of the bucket holding 'hash' while holding the lock
+static size_t htable_index_of(htable *self, uint64_t hash)
+{
+  return htable_fold_index(hash, self->cap, self->compact_cap, self->compact_next);
+}
+
+// Tag stored with each inline slot. Never 0, so it never matches an empty slot
+static uint16_t htable_tag(uint64_t hash)
+{
+  return (uint16_t) (hash >> 48) | 1;
+}
+
+static htable_node *htable_node_create(htable *self, const char *key, uint64_t hash, void *val)
+{
+  htable_node *node;
+
+  if (self->free_nodes != NULL) {
+    node = self->free_nodes;
+    self->free_nodes = node->next;
+  } else if ((node = self->alloc(1, sizeof(htable_node))) == NULL) {
+    return NULL;
+  }
+
+  // A reused node may still be looked at by an optimistic reader
+  htable_store(node->entry.key, key);
+  htable_store(node->entry.val, val);
+  htable_store(node->hash, hash);
+  htable_store(node->next, NULL);
+
+  return node;
+}
+
+// Find the arena 'node' was relocated into. Returns the link pointing to it, or NULL if the node was
+// allocated on its own
+static htable_arena **htable_arena_of(htable *self, htable_node *node)
+{
+  for (htable_arena **link = &self->arenas; *link != NULL; link = &(*link)->next) {
+    uintptr_t start = (uintptr_t) (*link)->nodes;
+
+    if ((uintptr_t) node >= start && (uintptr_t) node < start + (*link)->used * sizeof(htable_node)) {
+      return link;
+    }
+  }
+
+  return NULL;
+}
+
+static void htable_arena_free(htable *self, htable_arena **link)
+{
+  htable_arena *arena = *link;
+
+  *link = arena->next;
+  self->dealloc(arena->nodes);
+  self->dealloc(arena);
+}
+
+static void htable_node_destroy(htable *self, htable_node *node)
+{
+  htable_arena **link = NULL;
+
+  if (self->flags & HTABLE_OPTIMISTIC) {
+    htable_store(node->next, self->free_nodes);
+    self->free_nodes = node;
+  } else if (self->arenas == NULL || (link = htable_arena_of(self, node)) == NULL) {
+    self->dealloc(node);
+  } else if (--(*link)->live == 0 && !(*link == self->arenas && self->compacting == HTABLE_COMPACT_RELOCATE)) {
+    // The arena still being filled by htable_compact() is released once it's done
+    htable_arena_free(self, link);
+  }
+}
+
+// Release memory which a reader may still be looking at. Optimistic readers don't announce themselves,
+// so the memory is kept until the table is destroyed
+static void htable_retire(htable *self, void *mem, size_t size)
+{
+  htable_retired *retired;
+
+  if (!(self->flags & HTABLE_OPTIMISTIC)) {
+    self->dealloc(mem);
+    return;
+  }
+
+  if ((retired = self->alloc(1, sizeof(htable_retired))) == NULL) {
+    // Leaking is the only safe option left
+    return;
+  }
+
+  retired->mem = mem;
+  retired->size = size;
+  retired->next = self->retired;
+  self->retired = retired;
+}
+
+// The first cache line aligned bucket of 'mem'
+static htable_bucket *htable_inline_align(void *mem)
+{
+  return (htable_bucket *) (((uintptr_t) mem + sizeof(htable_bucket) - 1) & ~(uintptr_t) (sizeof(htable_bucket) - 1));
+}
+
+// Allocate 'cap' empty buckets for HTABLE_INLINE_BUCKETS, aligned to a cache line. The allocator gives no
+// alignment guarantee, so one extra bucket is allocated to align into. 'mem' is the pointer to free
+static htable_bucket *htable_inline_alloc(htable *self, size_t cap, void **mem)
+{
+  if ((*mem = self->alloc(cap + 1, sizeof(htable_bucket))) == NULL) {
+    return NULL;
+  }
+
+  return htable_inline_align(*mem);
+}
+
+static void htable_slot_fill(htable_bucket *bucket, int slot, const char *key, uint64_t hash, void *val)
+{
+  htable_store(bucket->slots[slot].key, key);
+  htable_store(bucket->slots[slot].val, val);
+  htable_store(bucket->tags[slot], htable_tag(hash));
+}
+
+static void htable_slot_clear(htable_bucket *bucket, int slot)
+{
+  htable_store(bucket->tags[slot], 0);
+  htable_store(bucket->slots[slot].key, NULL);
+  htable_store(bucket->slots[slot].val, NULL);
+}
+
+// Put an entry in a free slot of the bucket. Returns false if all slots are taken
+static bool htable_inline_fill(htable_bucket *bucket, const char *key, uint64_t hash, void *val)
+{
+  for (int i = 0; i < HTABLE_BUCKET_SLOTS; i++) {
+    if (bucket->tags[i] == 0) {
+      htable_slot_fill(bucket, i, key, hash, val);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void htable_inline_link(htable_bucket *bucket, htable_node *node)
+{
+  htable_store(node->next, bucket->overflow);
+  htable_store(bucket->overflow, node);
+}
+
+// Add an entry which isn't in the inline bucket yet, preferring a free slot over the overflow chain.
+// 'node' is an existing node to link if there's no free slot, or to release if there is one
+static bool htable_inline_insert(htable *self, htable_bucket *bucket, const char *key, uint64_t hash, void *val,
+                                 htable_node *node)
+{
+  if (htable_inline_fill(bucket, key, hash, val)) {
+    if (node != NULL) {
+      htable_node_destroy(self, node);
+    }
+
+    return true;
+  }
+
+  if (node == NULL && (node = htable_node_create(self, key, hash, val)) == NULL) {
+    return false;
+  }
+
+  htable_inline_link(bucket, node);
+
+  return true;
+}
+
+// Make sure the free list holds at least 'count' nodes, so relinking entries can't run out of them halfway.
+// Returns false if they can't be allocated
+static bool htable_node_reserve(htable *self, size_t count)
+{
+  size_t spare = 0;
+  htable_node *node = NULL;
+
+  for (node = self->free_nodes; node != NULL && spare < count; node = node->next) {
+    spare++;
+  }
+
+  for (; spare < count; spare++) {
+    if ((node = self->alloc(1, sizeof(htable_node))) == NULL) {
+      return false;
+    }
+
+    htable_store(node->next, self->free_nodes);
+    self->free_nodes = node;
+  }
+
+  return true;
+}
+
+// Release the nodes left over from relinking. Only optimistic tables keep a free list
+static void htable_node_trim(htable *self)
+{
+  htable_node *next = NULL;
+
+  if (self->flags & HTABLE_OPTIMISTIC) {
+    return;
+  }
+
+  for (htable_node *node = self->free_nodes; node != NULL; node = next) {
+    next = node->next;
+    self->dealloc(node);
+  }
+
+  self->free_nodes = NULL;
+}
+
+// Relink an entry into 'bucket' while resizing or folding. 'node' is the entry's overflow node, if it had
+// one. Nodes freed up go to the free list and nodes needed come from it, so once the caller has reserved
+// enough this can't fail
+static void htable_inline_move(htable *self, htable_bucket *bucket, const char *key, uint64_t hash, void *val,
+                               htable_node *node)
+{
+  if (htable_inline_fill(bucket, key, hash, val)) {
+    if (node != NULL) {
+      htable_store(node->next, self->free_nodes);
+      self->free_nodes = node;
+    }
+
+    return;
+  }
+
+  if (node == NULL) {
+    node = htable_node_create(self, key, hash, val);
+  }
+
+  htable_inline_link(bucket, node);
+}
+
+static htable_node *htable_chain_find(htable_node *node, const char *key, uint64_t hash)
+{
+  // Check each element in the chain for a key match. The loop will terminate
+  // when the reach the end or we find an entry with a matching key
+  for (; node != NULL && (node->hash != hash || strcmp(node->entry.key, key) != 0); node = node->next);
+
+  return node;
+}
+
+// Find the entry for 'key' in the bucket at 'index' while holding the lock
+static htable_entry *htable_find_at(htable *self, size_t index, const char *key, uint64_t hash)
+{
+  htable_node *node = NULL;
+
+  if (self->flags & HTABLE_INLINE_BUCKETS) {
+
+    htable_bucket *bucket = &self->inline_buckets[index];
+    uint16_t tag = htable_tag(hash);
+
+    for (int i = 0; i < HTABLE_BUCKET_SLOTS; i++) {
+      if (bucket->tags[i] == tag && strcmp(bucket->slots[i].key, key) == 0) {
+        return &bucket->slots[i];
+      }
+    }
+
+    node = htable_chain_find(bucket->overflow, key, hash);
+
+  } else {
+
+    node = htable_chain_find(self->buckets[index], key, hash);
+
+  }
+
+  return node == NULL ? NULL : &node->entry;
+}
+
+// Find the entry for 'key' while holding the lock
+static htable_entry *htable_find_locked(htable *self, const char *key, uint64_t hash)
+{
+  return htable_find_at(self, htable_index_of(self, hash), key, hash);
+}
+
+// Unlink the node for 'key' from the chain starting at 'link'. Returns the node, which the caller
+// has to release
+static htable_node *htable_chain_unlink(htable_node **link, const char *key, uint64_t hash)
+{
+  htable_node *node = NULL;
+
+  // Find matching entry, keeping the link which points to it
+  for (; *link != NULL; link = &(*link)->next) {
+    if ((*link)->hash == hash && strcmp((*link)->entry.key, key) == 0) {
+      break;
+    }
+  }
+
+  // If entry is not null, reconnect the previous link to next
+  if ((node = *link) != NULL) {
+    htable_store(*link, node->next);
+  }
+
+  return node;
+}
+
+// Mutation log records are a header followed by the key and the encoded value, without terminators:
+// 1 byte operation, 4 byte key length, 4 byte value length, all in host byte order
+#define HTABLE_LOG_SET 'S'
+#define HTABLE_LOG_REMOVE 'R'
+#define HTABLE_LOG_HEADER 9
+#define HTABLE_LOG_MIN_RING 4096
+#define HTABLE_LOG_MAX_FIELD (1u << 30) // Longest key or value in a record, anything longer is corruption
+
+static void htable_log_header(char *header, char op, uint32_t key_len, uint32_t val_len)
+{
+  header[0] = op;
+  memcpy(header + 1, &key_len, sizeof(key_len));
+  memcpy(header + 5, &val_len, sizeof(val_len));
+}
+
+// Get the bytes to log for a value. Without an encoder, values are logged as strings
+static uint32_t htable_log_value(htable_log_encode_fn encode, const void *val, const void **data)
+{
+  if (encode != NULL) {
+    return (uint32_t) encode(val, data);
+  }
+
+  *data = val;
+  return val == NULL ? 0 : (uint32_t) strlen(val);
+}
+
+static bool htable_write_full(int fd, const char *data, size_t len)
+{
+  while (len > 0) {
+    ssize_t written = write(fd, data, len);
+
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+
+    data += written;
+    len -= (size_t) written;
+  }
+
+  return true;
+}
+
+static void htable_log_copy(htable_log *log, size_t pos, const void *data, size_t len)
+{
+  size_t offset = pos & (log->cap - 1);
+  size_t first = len < log->cap - offset ? len : log->cap - offset;
+
+  if (len == 0) {
+    return;
+  }
+
+  memcpy(log->ring + offset, data, first);
+  memcpy(log->ring, (const char *) data + first, len - first);
+}
+
+// Append a record to the ring. Called with the write lock held, so there is only ever one producer and
+// appending is a copy and a store. Nothing here waits on the flusher: a record which doesn't fit is dropped
+// along with every later one, so what reaches the file is always a prefix of the changes
+static void htable_log_append(htable *self, char op, const char *key, const void *val)
+{
+  htable_log *log = self->log;
+  const void *data = NULL;
+  char header[HTABLE_LOG_HEADER];
+
+  if (log == NULL) {
+    return;
+  }
+
+  uint32_t key_len = (uint32_t) strlen(key);
+  uint32_t val_len = op == HTABLE_LOG_SET ? htable_log_value(log->encode, val, &data) : 0;
+  size_t len = HTABLE_LOG_HEADER + key_len + val_len;
+  size_t head = log->head;
+
+  if (log->dropped > 0 || key_len > HTABLE_LOG_MAX_FIELD || val_len > HTABLE_LOG_MAX_FIELD ||
+      head + len - htable_load(log->tail) > log->cap) {
+    htable_store(log->dropped, log->dropped + 1);
+    return;
+  }
+
+  htable_log_header(header, op, key_len, val_len);
+
+  htable_log_copy(log, head, header, HTABLE_LOG_HEADER);
+  htable_log_copy(log, head + HTABLE_LOG_HEADER, key, key_len);
+  htable_log_copy(log, head + HTABLE_LOG_HEADER + key_len, data, val_len);
+
+  htable_store(log->head, head + len);
+}
+
+// Background thread writing the ring to the log's file descriptor, as much as is available per write
+static void *htable_log_flusher(void *arg)
+{
+  htable_log *log = arg;
+  struct timespec idle = {0, 1000000};
+
+  for (;;) {
+
+    size_t head = htable_load(log->head);
+    size_t tail = log->tail;
+
+    if (head == tail) {
+      if (htable_load(log->stop)) {
+        break;
+      }
+
+      nanosleep(&idle, NULL);
+      continue;
+    }
+
+    // Write up to the end of the ring, anything wrapped around goes in the next round
+    size_t offset = tail & (log->cap - 1);
+    size_t len = head - tail < log->cap - offset ? head - tail : log->cap - offset;
+
+    // On failure the data is dropped anyway, so writers never wait on a dead log
+    if (!htable_write_full(log->fd, log->ring + offset, len)) {
+      htable_store(log->error, errno);
+    }
+
+    htable_store(log->tail, tail + len);
+
+  }
+
+  return NULL;
+}
+
+// The errno a log reports. A write error explains the gap better than the dropped records which may
+// follow it
+static int htable_log_errno(htable_log *log)
+{
+  int error = htable_load(log->error);
+
+  return error != 0 ? error : htable_load(log->dropped) > 0 ? ENOBUFS : 0;
+}
+
+// Add 'key', which must not be in the table yet, while holding the write lock. Returns false if no node
+// could be allocated for it
+static bool htable_insert_locked(htable *self, const char *key, uint64_t hash, void *val)
+{
+  bool inserted = false;
+
+  if (self->flags & HTABLE_INLINE_BUCKETS) {
+
+    inserted = htable_inline_insert(self, &self->inline_buckets[htable_index_of(self, hash)], key, hash, val, NULL);
+
+  } else {
+
+    htable_node **head = &self->buckets[htable_index_of(self, hash)];
+    htable_node *node = htable_node_create(self, key, hash, val);
+
+    if (node != NULL) {
+      htable_store(node->next, *head);
+      htable_store(*head, node);
+      inserted = true;
+    }
+
+  }
+
+  if (inserted) {
+    self->size++;
+  }
+
+  return inserted;
+}
+
+// Set 'key' while holding the write lock
+static void htable_set_locked(htable *self, const char *key, uint64_t hash, void *val)
+{
+  htable_entry *entry = htable_find_locked(self, key, hash);
+
+  if (entry != NULL) {
+    htable_store(entry->val, val);
+  } else {
+    // If no entry was found, create a new one at the head of the bucket
+    htable_insert_locked(self, key, hash, val);
+  }
+
+  htable_log_append(self, HTABLE_LOG_SET, key, val);
+}
+
+// Remove 'key' while holding the write lock
+static void *htable_remove_locked(htable *self, const char *key, uint64_t hash)
+{
+  void *value = NULL;
+  htable_node *node = NULL;
+
+  if (self->flags & HTABLE_INLINE_BUCKETS) {
+
+    htable_bucket *bucket = &self->inline_buckets[htable_index_of(self, hash)];
+    uint16_t tag = htable_tag(hash);
+
+    for (int i = 0; i < HTABLE_BUCKET_SLOTS; i++) {
+
+      if (bucket->tags[i] != tag || strcmp(bucket->slots[i].key, key) != 0) {
+        continue;
+      }
+
+      value = bucket->slots[i].val;
+      self->size--;
+
+      // Pull the first overflow node into the slot, keeping as many entries inline as possible
+      if ((node = bucket->overflow) != NULL) {
+        htable_store(bucket->overflow, node->next);
+        htable_slot_fill(bucket, i, node->entry.key, node->hash, node->entry.val);
+        htable_node_destroy(self, node);
+      } else {
+        htable_slot_clear(bucket, i);
+      }
+
+      htable_log_append(self, HTABLE_LOG_REMOVE, key, NULL);
+      return value;
+
+    }
+
+    node = htable_chain_unlink(&bucket->overflow, key, hash);
+
+  } else {
+
+    node = htable_chain_unlink(&self->buckets[htable_index_of(self, hash)], key, hash);
+
+  }
+
+  if (node != NULL) {
+    value = node->entry.val;
+    htable_node_destroy(self, node);
+    self->size--;
+    htable_log_append(self, HTABLE_LOG_REMOVE, key, NULL);
+  }
+
+  return value;
+}
+
+static bool htable_write_record(FILE *out, char op, const char *key, const void *data, uint32_t val_len)
+{
+  char header[HTABLE_LOG_HEADER];
+  uint32_t key_len = (uint32_t) strlen(key);
+
+  htable_log_header(header, op, key_len, val_len);
+
+  return fwrite(header, 1, HTABLE_LOG_HEADER, out) == HTABLE_LOG_HEADER && fwrite(key, 1, key_len, out) == key_len &&
+         fwrite(data, 1, val_len, out) == val_len;
+}
+
+// Apply one replayed record while holding the write lock. The table owns replayed keys and values,
+// so whatever a record replaces is released
+static void htable_replay_record(htable *self, char op, char *key, void *val)
+{
+  uint64_t hash = hash_fn(key);
+  htable_entry *entry = htable_find_locked(self, key, hash);
+
+  if (op == HTABLE_LOG_SET) {
+
+    if (entry == NULL) {
+      htable_insert_locked(self, key, hash, val);
+      htable_log_append(self, op, key, val);
+      return;
+    }
+
+    void *old = entry->val;
+
+    htable_store(entry->val, val);
+    htable_log_append(self, op, key, val);
+    self->dealloc(old);
+
+  } else if (op == HTABLE_LOG_REMOVE && entry != NULL) {
+
+    char *old_key = (char *) entry->key;
+
+    // Optimistic readers may still be comparing against the old key
+    self->dealloc(htable_remove_locked(self, key, hash));
+    htable_retire(self, old_key, strlen(old_key) + 1);
+
+  }
+
+  self->dealloc(key);
+}
+
+// Push a mutation onto the pending queue without locking. Returns false if it couldn't be allocated
+static bool htable_enqueue(htable *self, const char *key, uint64_t hash, void *val, bool remove)
+{
+  htable_op *op;
+
+  if ((op = self->alloc(1, sizeof(htable_op))) == NULL) {
+    return false;
+  }
+
+  op->key = key;
+  op->hash = hash;
+  op->val = val;
+  op->remove = remove;
+  op->next = __atomic_load_n(&self->pending, __ATOMIC_RELAXED);
+
+  while (!__atomic_compare_exchange_n(&self->pending, &op->next, op, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  return true;
+}
+
+// Apply every queued mutation, in the order they were queued. Must hold the write lock
+static void htable_apply_pending(htable *self)
+{
+  htable_op *op = NULL;
+  htable_op *next = NULL;
+  htable_op *ordered = NULL;
+
+  if (__atomic_load_n(&self->pending, __ATOMIC_RELAXED) == NULL) {
+    return;
+  }
+
+  // The queue is a stack, newest first. Take all of it at once and reverse it
+  for (op = __atomic_exchange_n(&self->pending, NULL, __ATOMIC_ACQUIRE); op != NULL; op = next) {
+    next = op->next;
+    op->next = ordered;
+    ordered = op;
+  }
+
+  for (op = ordered; op != NULL; op = next) {
+    next = op->next;
+
+    if (op->remove) {
+      htable_remove_locked(self, op->key, op->hash);
+    } else {
+      htable_set_locked(self, op->key, op->hash, op->val);
+    }
+
+    self->dealloc(op);
+  }
+}
+
+// Start a write once the write lock is held. Any writer applies the queued mutations first, so
+// a thread's queued operations always land before its direct ones
+static void htable_write_begin(htable *self)
+{
+  // Make the sequence odd before touching anything, so optimistic readers know to retry
+  __atomic_store_n(&self->seq, self->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  htable_apply_pending(self);
+}
+
+static void htable_write_lock(htable *self)
+{
+  pthread_rwlock_wrlock(&self->mu);
+  htable_write_begin(self);
+}
+
+static void htable_write_release(htable *self)
+{
+  htable_store(self->seq, self->seq + 1);
+
+  pthread_rwlock_unlock(&self->mu);
+}
+
+// Apply queued mutations if nobody else holds the table. Whoever gets the lock applies everything
+// queued so far under that one acquisition, the others return and leave their operations behind
+static void htable_combine(htable *self)
+{
+  // Operations queued while we held the lock would otherwise wait for the next writer
+  while (__atomic_load_n(&self->pending, __ATOMIC_RELAXED) != NULL && pthread_rwlock_trywrlock(&self->mu) == 0) {
+    htable_write_begin(self);
+    htable_write_release(self);
+  }
+}
+
+// Whoever releases the table applies what was queued while it held it. Threads which queued an operation
+// and failed to take the lock rely on this, since they never come back for it
+static void htable_write_unlock(htable *self)
+{
+  htable_apply_pending(self);
+  htable_write_release(self);
+
+  // Operations queued between applying and unlocking
+  htable_combine(self);
+}
+
+static void htable_read_unlock(htable *self)
+{
+  pthread_rwlock_unlock(&self->mu);
+  htable_combine(self);
+}
+
+// Wait until no writer holds the table and return the sequence to validate against
+static size_t htable_read_begin(htable *self)
+{
+  size_t seq;
+
+  while ((seq = htable_load(self->seq)) & 1) {
+    sched_yield();
+  }
+
+  return seq;
+}
+
+// Check if any writer started since htable_read_begin() returned 'seq'
+static bool htable_read_valid(htable *self, size_t seq)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&self->seq, __ATOMIC_RELAXED) == seq;
+}
+
+// Walk a chain without holding the lock. Returns false if a writer interfered, otherwise 'val' holds
+// the value found, if any
+static bool htable_chain_get_optimistic(htable *self, size_t seq, htable_node *node, const char *key, uint64_t hash,
+                                        htable_entry *found)
+{
+  // Any node may be unlinked and reused while we look at it. Validating at every step keeps the
+  // walk from following a reused node into another chain, and from comparing against stale keys
+  while (node != NULL && htable_read_valid(self, seq)) {
+
+    const char *node_key = htable_load(node->entry.key);
+
+    if (htable_load(node->hash) == hash && strcmp(node_key, key) == 0) {
+      found->key = node_key;
+      found->val = htable_load(node->entry.val);
+      break;
+    }
+
+    node = htable_load(node->next);
+
+  }
+
+  return htable_read_valid(self, seq);
+}
+
+static bool htable_inline_get_optimistic(htable *self, size_t seq, htable_bucket *bucket, const char *key,
+                                         uint64_t hash, htable_entry *found)
+{
+  uint16_t tag = htable_tag(hash);
+
+  for (int i = 0; i < HTABLE_BUCKET_SLOTS; i++) {
+
+    if (htable_load(bucket->tags[i]) != tag) {
+      continue;
+    }
+
+    // The slot may have been cleared since its tag was read
+    const char *slot_key = htable_load(bucket->slots[i].key);
+
+    if (slot_key != NULL && htable_read_valid(self, seq) && strcmp(slot_key, key) == 0) {
+      found->key = slot_key;
+      found->val = htable_load(bucket->slots[i].val);
+      return htable_read_valid(self, seq);
+    }
+
+  }
+
+  return htable_chain_get_optimistic(self, seq, htable_load(bucket->overflow), key, hash, found);
+}
+
+// Look up 'key' without locking. Fills 'found' with the table's entry, if there is one, and returns the
+// write sequence the result is valid for
+static size_t htable_get_optimistic(htable *self, const char *key, uint64_t hash, htable_entry *found)
+{
+  for (;;) {
+
+    size_t seq = htable_read_begin(self);
+    htable_node **buckets = htable_load(self->buckets);
+    htable_bucket *inline_buckets = htable_load(self->inline_buckets);
+    size_t cap = htable_load(self->cap);
+    size_t index = htable_fold_index(hash, cap, htable_load(self->compact_cap), htable_load(self->compact_next));
+    bool valid = false;
+
+    // The array, cap and compaction progress must belong together before indexing
+    if (!htable_read_valid(self, seq)) {
+      continue;
+    }
+
+    found->key = NULL;
+    found->val = NULL;
+
+    if (self->flags & HTABLE_INLINE_BUCKETS) {
+      valid = htable_inline_get_optimistic(self, seq, &inline_buckets[index], key, hash, found);
+    } else {
+      valid = htable_chain_get_optimistic(self, seq, htable_load(buckets[index]), key, hash, found);
+    }
+
+    if (valid) {
+      return seq;
+    }
+
+  }
+}
+
+static size_t htable_cache_index(uint64_t hash)
+{
+  // The bucket index uses the low bits, so take the cache slot from higher ones
+  return (size_t) (hash >> 32) & (HTABLE_CACHE_SLOTS - 1);
+}
+
+// Check the calling thread's cache for 'key'. An entry is only good for the write sequence it was filled
+// at, so any write to the table since invalidates it. Nothing stops a write right after the sequence is
+// checked, which may free the table's key, so the key is compared against the thread's own copy
+static bool htable_cache_get(htable *self, htable_cache_entry *cached, const char *key, uint64_t hash)
+{
+  size_t seq = htable_load(self->seq);
+
+  if (cached->id == self->id && cached->seq == seq && cached->hash == hash &&
+      (cached->key == key || (cached->copied && strcmp(cached->copy, key) == 0))) {
+    htable_cache_counters.hits++;
+    return true;
+  }
+
+  htable_cache_counters.misses++;
+  return false;
+}
+
+static htable_node *htable_iterator_next_node(htable_itr *itr)
+{
+  // Get the next element in the table. If there are no more elements, then null is returned
+  htable_node *node = NULL;
+
+  // Get entry linked to the current
+  if (itr->node != NULL && itr->node->next != NULL) {
+
+    node = itr->node->next;
+
+  } else {
+
+    // Get entry from the next bucket
+    while (node == NULL && itr->next_bucket < itr->tab->cap) {
+
+      if (itr->tab->buckets[itr->next_bucket] != NULL) {
+        node = itr->tab->buckets[itr->next_bucket];
+      }
+
+      itr->next_bucket++;
+
+    }
+
+    // If there are no linked entries and no more buckets, the iterator is finished
+  }
+
+  itr->node = node;
+  return node;
+}
+
+static htable_entry *htable_iterator_next_inline(htable_itr *itr)
+{
+  // Slots of the current bucket come first, then its overflow chain
+  while (itr->next_bucket < itr->tab->cap) {
+
+    htable_bucket *bucket = &itr->tab->inline_buckets[itr->next_bucket];
+
+    while (itr->slot < HTABLE_BUCKET_SLOTS) {
+      htable_entry *entry = &bucket->slots[itr->slot++];
+
+      if (entry->key != NULL) {
+        return entry;
+      }
+    }
+
+    itr->node = itr->node == NULL ? bucket->overflow : itr->node->next;
+
+    if (itr->node != NULL) {
+      return &itr->node->entry;
+    }
+
+    itr->slot = 0;
+    itr->next_bucket++;
+
+  }
+
+  return NULL;
+}
+
+// Release every node of a chain
+static void htable_chain_free(htable *self, htable_node *node)
+{
+  htable_node *next = NULL;
+
+  for (; node != NULL; node = next) {
+    next = node->next;
+
+    // Arenas are released as a whole
+    if (self->arenas == NULL || htable_arena_of(self, node) == NULL) {
+      self->dealloc(node);
+    }
+  }
+}
+
+static htable *htable_init(void *(*alloc)(size_t, size_t), void (*dealloc)(void *), size_t size, unsigned int flags)
+{
+  htable *self;
+
+  if ((self = alloc(1, sizeof(htable))) == NULL) {
+    return NULL;
+  }
+
+  self->alloc = alloc;
+  self->dealloc = dealloc;
+  self->buckets = NULL;
+  self->inline_buckets = NULL;
+  self->inline_mem = NULL;
+
+  if (flags & HTABLE_INLINE_BUCKETS) {
+    self->inline_buckets = htable_inline_alloc(self, size, &self->inline_mem);
+  } else {
+    self->buckets = alloc(size, sizeof(htable_node *));
+  }
+
+  if (self->buckets == NULL && self->inline_buckets == NULL) {
+    dealloc(self);
+    return NULL;
+  }
+
+  self->size = 0;
+  self->cap = size;
+  self->flags = flags;
+  self->seq = 0;
+  self->free_nodes = NULL;
+  self->retired = NULL;
+  self->pending = NULL;
+  self->log = NULL;
+  self->compacting = HTABLE_COMPACT_IDLE;
+  self->compact_cap = size;
+  self->compact_next = 0;
+  self->compact_seq = SIZE_MAX;
+  self->arenas = NULL;
+  self->id = __atomic_fetch_add(&htable_next_id, 1, __ATOMIC_RELAXED);
+
+  pthread_rwlock_init(&self->mu, NULL);
+
+  return self;
+}
+
+// Memory for htable_compact(), allocated and released without holding the write lock. A step which needs
+// memory asks for 'count' elements of 'size' bytes and the caller allocates them before the next step
+typedef struct htable_compact_mem
+{
+  void *block;
+  size_t count;
+  size_t size;
+  bool failed;   // Whether allocating the requested block failed
+  bool stalled;  // A step ran out of memory under the lock, so the next call retries it
+  void *garbage; // Memory the table let go of, released once unlocked
+} htable_compact_mem;
+
+// Take the block allocated for a step needing at least 'count' elements of 'size' bytes. Returns false if
+// the step has to wait for one. If allocating it failed, the block is NULL
+static bool htable_compact_take(htable_compact_mem *mem, size_t count, size_t size, void **block)
+{
+  if ((mem->block != NULL || mem->failed) && mem->size == size && mem->count >= count) {
+    *block = mem->block;
+    mem->block = NULL;
+    return true;
+  }
+
+  mem->count = count;
+  mem->size = size;
+  mem->failed = false;
+
+  return false;
+}
+
+// Finish or cancel a compaction. The arena being filled is released if none of its nodes are left
+static void htable_compact_end(htable *self)
+{
+  if (self->compacting == HTABLE_COMPACT_RELOCATE && self->arenas->live == 0) {
+    htable_arena_free(self, &self->arenas);
+  }
+
+  self->compacting = HTABLE_COMPACT_IDLE;
+  htable_store(self->compact_next, 0);
+  htable_store(self->compact_cap, self->cap);
+}
+
+// Move on to relocating nodes. Nodes of inline and optimistic tables stay where they are. Unless the array
+// was just folded, which reorders the chains, neither do nodes which are dense already: at most an eighth
+// of them outside the last arena, which still holds at least half of what it was sized for
+static void htable_compact_relocate(htable *self, bool folded)
+{
+  htable_arena *arena = self->arenas;
+  bool dense = arena != NULL && self->size - arena->live <= self->size / 8 && arena->live >= arena->cap / 2;
+
+  if ((self->flags & (HTABLE_INLINE_BUCKETS | HTABLE_OPTIMISTIC)) || self->size == 0 || (dense && !folded)) {
+    htable_compact_end(self);
+    return;
+  }
+
+  self->compacting = HTABLE_COMPACT_ARENA;
+  htable_store(self->compact_next, 0);
+  htable_store(self->compact_cap, self->cap);
+}
+
+static void htable_compact_start(htable *self)
+{
+  size_t cap = 1;
+
+  while (cap < self->size) {
+    cap <<= 1;
+  }
+
+  // Folding relies on the buckets of the smaller array being the low bits of the larger one's
+  if (cap < self->cap && (self->cap & (self->cap - 1)) == 0) {
+    self->compacting = HTABLE_COMPACT_FOLD;
+    htable_store(self->compact_cap, cap);
+
+    // Buckets below the new capacity fold into themselves
+    htable_store(self->compact_next, cap);
+  } else {
+    htable_compact_relocate(self, false);
+  }
+}
+
+// Move the entries of bucket 'index' into the first compact_cap buckets, adding the number moved to 'moved'.
+// Returns false, leaving the bucket as it is, if nodes for its entries can't be allocated
+static bool htable_fold_bucket(htable *self, size_t index, size_t *moved)
+{
+  htable_node *node = NULL;
+  htable_node *next = NULL;
+
+  if (self->flags & HTABLE_INLINE_BUCKETS) {
+
+    htable_bucket *buckets = self->inline_buckets;
+    htable_bucket *bucket = &buckets[index];
+    size_t slots = 0;
+
+    for (int i = 0; i < HTABLE_BUCKET_SLOTS; i++) {
+      slots += bucket->slots[i].key != NULL;
+    }
+
+    // Every entry of the bucket folds into the same bucket. Its overflow nodes move first, so only the
+    // slot entries may need a node
+    if (!htable_node_reserve(self, slots)) {
+      return false;
+    }
+
+    node = bucket->overflow;
+    htable_store(bucket->overflow, NULL);
+
+    for (; node != NULL; node = next) {
+      next = node->next;
+      htable_inline_move(self, &buckets[htable_index(node->hash, self->compact_cap)], node->entry.key, node->hash,
+                         node->entry.val, node);
+      (*moved)++;
+    }
+
+    // Inline slots only keep a tag, so their keys are rehashed
+    for (int i = 0; i < HTABLE_BUCKET_SLOTS; i++) {
+      htable_entry *entry = &bucket->slots[i];
+
+      if (entry->key == NULL) {
+        continue;
+      }
+
+      uint64_t hash = hash_fn(entry->key);
+
+      htable_inline_move(self, &buckets[htable_index(hash, self->compact_cap)], entry->key, hash, entry->val, NULL);
+      htable_slot_clear(bucket, i);
+      (*moved)++;
+    }
+
+    htable_node_trim(self);
+
+  } else {
+
+    node = self->buckets[index];
+    htable_store(self->buckets[index], NULL);
+
+    for (; node != NULL; node = next) {
+      htable_node **head = &self->buckets[htable_index(node->hash, self->compact_cap)];
+
+      next = node->next;
+      htable_store(node->next, *head);
+      htable_store(*head, node);
+      (*moved)++;
+    }
+
+  }
+
+  return true;
+}
+
+// Replace the array by one of compact_cap buckets once every bucket above it is folded. If the smaller
+// array couldn't be allocated the table keeps using the first compact_cap buckets of the current one.
+// Returns false if the step has to wait for memory
+static bool htable_compact_shrink(htable *self, htable_compact_mem *mem)
+{
+  size_t cap = self->compact_cap;
+  void *block = NULL;
+  void *old = NULL;
+
+  if (self->flags & HTABLE_INLINE_BUCKETS) {
+
+    if (!htable_compact_take(mem, cap + 1, sizeof(htable_bucket), &block)) {
+      return false;
+    }
+
+    if (block != NULL) {
+      htable_bucket *buckets = htable_inline_align(block);
+
+      memcpy(buckets, self->inline_buckets, cap * sizeof(htable_bucket));
+
+      old = self->inline_mem;
+      self->inline_mem = block;
+      htable_store(self->inline_buckets, buckets);
+    }
+
+  } else {
+
+    if (!htable_compact_take(mem, cap, sizeof(htable_node *), &block)) {
+      return false;
+    }
+
+    if (block != NULL) {
+      memcpy(block, self->buckets, cap * sizeof(htable_node *));
+
+      old = self->buckets;
+      htable_store(self->buckets, (htable_node **) block);
+    }
+
+  }
+
+  // Optimistic readers may still be on the old array
+  if (old != NULL && (self->flags & HTABLE_OPTIMISTIC)) {
+    htable_retire(self, old, self->flags & HTABLE_INLINE_BUCKETS ? (self->cap + 1) * sizeof(htable_bucket) :
+                             self->cap * sizeof(htable_node *));
+  } else {
+    mem->garbage = old;
+  }
+
+  htable_store(self->cap, cap);
+
+  htable_compact_relocate(self, true);
+
+  return true;
+}
+
+// Set up the arena nodes are relocated into, sized for every entry. Returns false if the step has to
+// wait for memory
+static bool htable_compact_arena(htable *self, htable_compact_mem *mem)
+{
+  htable_arena *arena = NULL;
+  void *block = NULL;
+
+  // Entries added meanwhile are left where they are if the arena runs out
+  if (!htable_compact_take(mem, 1, sizeof(htable_node), &block)) {
+    mem->count = self->size;
+    return false;
+  }
+
+  if (block == NULL || (arena = self->alloc(1, sizeof(htable_arena))) == NULL) {
+    mem->garbage = block;
+    htable_compact_end(self);
+    return true;
+  }
+
+  arena->nodes = block;
+  arena->cap = mem->count;
+  arena->used = 0;
+  arena->live = 0;
+  arena->next = self->arenas;
+  self->arenas = arena;
+
+  self->compacting = HTABLE_COMPACT_RELOCATE;
+
+  return true;
+}
+
+// Copy the chain of bucket 'index' into the arena, keeping its order. Returns the number of entries copied
+static size_t htable_relocate_bucket(htable *self, size_t index)
+{
+  htable_arena *arena = self->arenas;
+  htable_node **link = &self->buckets[index];
+  size_t copied = 0;
+
+  // Entries added since the arena was sized stay where they are once it's full
+  for (htable_node *node = *link; node != NULL && arena->used < arena->cap; node = *link) {
+    htable_node *copy = &arena->nodes[arena->used++];
+
+    *copy = *node;
+    arena->live++;
+
+    htable_store(*link, copy);
+    link = &copy->next;
+
+    htable_node_destroy(self, node);
+    copied++;
+  }
+
+  return copied;
+}
+
+// Do one step of the running compaction: one bucket, replacing the array once folding is done, or setting
+// up the arena. Returns the number of buckets and entries visited, 0 if the step has to wait for memory or
+// stalled
+static size_t htable_compact_step(htable *self, htable_compact_mem *mem)
+{
+  size_t index = self->compact_next;
+  size_t visited = 0;
+
+  if (self->compacting == HTABLE_COMPACT_ARENA) {
+    return htable_compact_arena(self, mem) ? 1 : 0;
+  }
+
+  if (index == self->cap) {
+
+    if (self->compacting == HTABLE_COMPACT_FOLD) {
+      return htable_compact_shrink(self, mem) ? 1 : 0;
+    }
+
+    htable_compact_end(self);
+    return 1;
+
+  }
+
+  if (self->compacting == HTABLE_COMPACT_FOLD) {
+    if (!htable_fold_bucket(self, index, &visited)) {
+      mem->stalled = true;
+      return 0;
+    }
+  } else {
+    visited = htable_relocate_bucket(self, index);
+  }
+
+  htable_store(self->compact_next, index + 1);
+
+  return visited + 1;
+}
+
+static void htable_resize_inline(htable *self, size_t size)
+{
+  void *mem = NULL;
+  htable_bucket *buckets;
+  size_t *counts;
+  size_t overflow = 0;
+  size_t needed = 0;
+
+  if ((buckets = htable_inline_alloc(self, size, &mem)) == NULL) {
+    return;
+  }
+
+  if ((counts = self->alloc(size, sizeof(size_t))) == NULL) {
+    self->dealloc(mem);
+    return;
+  }
+
+  htable_write_lock(self);
+
+  // Count the entries landing in each new bucket, to reserve every overflow node the new array needs
+  // beyond the ones it reuses. The resize then either happens as a whole or not at all. Inline slots only
+  // keep a tag, so their keys are rehashed
+  for (size_t i = 0; i < self->cap; i++) {
+
+    htable_bucket *bucket = &self->inline_buckets[i];
+
+    for (int j = 0; j < HTABLE_BUCKET_SLOTS; j++) {
+      if (bucket->slots[j].key != NULL) {
+        counts[htable_index(hash_fn(bucket->slots[j].key), size)]++;
+      }
+    }
+
+    for (htable_node *node = bucket->overflow; node != NULL; node = node->next) {
+      counts[htable_index(node->hash, size)]++;
+      overflow++;
+    }
+
+  }
+
+  for (size_t i = 0; i < size; i++) {
+    if (counts[i] > HTABLE_BUCKET_SLOTS) {
+      needed += counts[i] - HTABLE_BUCKET_SLOTS;
+    }
+  }
+
+  if (needed > overflow && !htable_node_reserve(self, needed - overflow)) {
+    htable_node_trim(self);
+    htable_write_unlock(self);
+
+    self->dealloc(counts);
+    self->dealloc(mem);
+    return;
+  }
+
+  // Overflow nodes move first, so the ones freed up are on the free list before a slot entry needs one
+  for (size_t i = 0; i < self->cap; i++) {
+
+    htable_node *next = NULL;
+
+    for (htable_node *node = self->inline_buckets[i].overflow; node != NULL; node = next) {
+      next = node->next;
+      htable_inline_move(self, &buckets[htable_index(node->hash, size)], node->entry.key, node->hash, node->entry.val,
+                         node);
+    }
+
+  }
+
+  for (size_t i = 0; i < self->cap; i++) {
+    for (int j = 0; j < HTABLE_BUCKET_SLOTS; j++) {
+      htable_entry *entry = &self->inline_buckets[i].slots[j];
+
+      if (entry->key != NULL) {
+        uint64_t hash = hash_fn(entry->key);
+        htable_inline_move(self, &buckets[htable_index(hash, size)], entry->key, hash, entry->val, NULL);
+      }
+    }
+  }
+
+  htable_node_trim(self);
+
+  // Free old bucket array
+  htable_retire(self, self->inline_mem, (self->cap + 1) * sizeof(htable_bucket));
+
+  self->inline_mem = mem;
+  htable_store(self->inline_buckets, buckets);
+  htable_store(self->cap, size);
+  htable_compact_end(self);
+
+  htable_write_unlock(self);
+
+  self->dealloc(counts);
+}
+
+// Remove every entry while holding the write lock
+static void htable_clear_locked(htable *self)
+{
+  htable_node *node = NULL;
+  htable_node *next = NULL;
+
+  for (size_t i = 0; i < self->cap; i++) {
+
+    if (self->flags & HTABLE_INLINE_BUCKETS) {
+
+      htable_bucket *bucket = &self->inline_buckets[i];
+
+      for (int j = 0; j < HTABLE_BUCKET_SLOTS; j++) {
+        htable_slot_clear(bucket, j);
+      }
+
+      node = bucket->overflow;
+      htable_store(bucket->overflow, NULL);
+
+    } else {
+
+      node = self->buckets[i];
+      htable_store(self->buckets[i], NULL);
+
+    }
+
+    for (; node != NULL; node = next) {
+      next = node->next;
+      htable_node_destroy(self, node);
+    }
+
+  }
+
+  self->size = 0;
+}
+
+// Lock two tables in address order, so threads locking the same pair can't deadlock
+static void htable_write_lock_pair(htable *a, htable *b)
+{
+  if ((uintptr_t) a > (uintptr_t) b) {
+    htable *tmp = a;
+    a = b;
+    b = tmp;
+  }
+
+  htable_write_lock(a);
+  htable_write_lock(b);
+}
+
+static void htable_read_lock_pair(htable *a, htable *b)
+{
+  if ((uintptr_t) a > (uintptr_t) b) {
+    htable *tmp = a;
+    a = b;
+    b = tmp;
+  }
+
+  pthread_rwlock_rdlock(&a->mu);
+
+  if (a != b) {
+    pthread_rwlock_rdlock(&b->mu);
+  }
+}
+
+// One thread's share of a bucket-wise htable_merge(), htable_diff() or htable_intersect(). Only used when
+// the tables have the same capacity, so bucket i of src can only ever meet bucket i of the others
+typedef struct htable_setop
+{
+  htable *dst;                 // Table receiving entries
+  htable *src;                 // Table entries come from. Merging empties it
+  htable *other;               // Table src is compared with by diff and intersect
+  htable_conflict_fn conflict; // Merge only, NULL means the src value wins
+  bool merge;
+  bool keep_common;            // Whether entries also in 'other' are kept (intersect) or dropped (diff)
+  size_t from;                 // First bucket of the range
+  size_t to;                   // End of the range, exclusive
+  size_t added;                // Entries added to dst
+  size_t removed;              // Entries merged out of src
+  bool failed;                 // Whether a node couldn't be allocated, leaving its entry out of dst
+
+  // Nodes of src released by this thread, handed back to src once every thread is done since the tables'
+  // free lists aren't shared between threads. New nodes are taken from here first
+  htable_node *spare;
+} htable_setop;
+
+static htable_node *htable_setop_node(htable_setop *op, const char *key, uint64_t hash, void *val)
 {
   htable_node *node;
 
-  if ((node = self->alloc(1, sizeof(htable_node))) == NULL) {
-    return NULL;
+  if ((node = op->spare) != NULL) {
+    op->spare = node->next;
+  } else if ((node = op->dst->alloc(1, sizeof(htable_node))) == NULL) {
+    return NULL;
+  }
+
+  htable_store(node->entry.key, key);
+  htable_store(node->entry.val, val);
+  htable_store(node->hash, hash);
+  htable_store(node->next, NULL);
+
+  return node;
+}
+
+static void htable_setop_release(htable_setop *op, htable_node *node)
+{
+  // An optimistic reader of src may still be on the node, so it goes back to src, which only frees it
+  // when it isn't optimistic
+  htable_store(node->next, op->spare);
+  op->spare = node;
+}
+
+// Add an entry to bucket 'index' of dst. 'node' is a node of src to move over, or NULL to allocate one.
+// Returns false if that allocation failed
+static bool htable_setop_add(htable_setop *op, size_t index, const char *key, uint64_t hash, void *val,
+                             htable_node *node)
+{
+  htable *dst = op->dst;
+
+  if (dst->flags & HTABLE_INLINE_BUCKETS) {
+
+    htable_bucket *bucket = &dst->inline_buckets[index];
+
+    if (htable_inline_fill(bucket, key, hash, val)) {
+      if (node != NULL) {
+        htable_setop_release(op, node);
+      }
+
+      op->added++;
+      return true;
+    }
+
+    if (node == NULL && (node = htable_setop_node(op, key, hash, val)) == NULL) {
+      return false;
+    }
+
+    htable_inline_link(bucket, node);
+
+  } else {
+
+    if (node == NULL && (node = htable_setop_node(op, key, hash, val)) == NULL) {
+      return false;
+    }
+
+    htable_store(node->next, dst->buckets[index]);
+    htable_store(dst->buckets[index], node);
+
+  }
+
+  op->added++;
+  return true;
+}
+
+// Handle one entry of src. Returns false if it had to go to dst and couldn't, in which case a merge leaves
+// it in src. Only entries without a node to move can fail
+static bool htable_setop_entry(htable_setop *op, size_t index, const char *key, uint64_t hash, void *val,
+                               htable_node *node)
+{
+  if (op->merge) {
+
+    htable_entry *entry = htable_find_at(op->dst, index, key, hash);
+
+    if (entry == NULL && !htable_setop_add(op, index, key, hash, val, node)) {
+      op->failed = true;
+      return false;
+    }
+
+    // Merging removes the entry from src whatever happens to it in dst
+    htable_log_append(op->src, HTABLE_LOG_REMOVE, key, NULL);
+    op->removed++;
+
+    if (entry != NULL) {
+      htable_store(entry->val, op->conflict == NULL ? val : op->conflict(key, entry->val, val));
+      htable_log_append(op->dst, HTABLE_LOG_SET, key, entry->val);
+
+      if (node != NULL) {
+        htable_setop_release(op, node);
+      }
+    } else {
+      htable_log_append(op->dst, HTABLE_LOG_SET, key, val);
+    }
+
+  } else if ((htable_find_at(op->other, index, key, hash) != NULL) == op->keep_common &&
+             !htable_setop_add(op, index, key, hash, val, node)) {
+    op->failed = true;
+    return false;
+  }
+
+  return true;
+}
+
+static void htable_setop_bucket(htable_setop *op, size_t index)
+{
+  htable *src = op->src;
+  htable_node *node = NULL;
+  htable_node *next = NULL;
+
+  if (src->flags & HTABLE_INLINE_BUCKETS) {
+
+    htable_bucket *bucket = &src->inline_buckets[index];
+
+    // Slots only keep a tag, the full hash is needed to compare against overflow nodes
+    for (int i = 0; i < HTABLE_BUCKET_SLOTS; i++) {
+      htable_entry *entry = &bucket->slots[i];
+
+      if (entry->key != NULL && htable_setop_entry(op, index, entry->key, hash_fn(entry->key), entry->val, NULL) &&
+          op->merge) {
+        htable_slot_clear(bucket, i);
+      }
+    }
+
+    node = bucket->overflow;
+
+    if (op->merge) {
+      htable_store(bucket->overflow, NULL);
+    }
+
+  } else {
+
+    node = src->buckets[index];
+
+    if (op->merge) {
+      htable_store(src->buckets[index], NULL);
+    }
+
+  }
+
+  // Merging moves nodes over to dst as they are, otherwise they stay in src
+  for (; node != NULL; node = next) {
+    next = node->next;
+    htable_setop_entry(op, index, node->entry.key, node->hash, node->entry.val, op->merge ? node : NULL);
+  }
+}
+
+static void *htable_setop_run(void *arg)
+{
+  htable_setop *op = arg;
+
+  for (size_t i = op->from; i < op->to; i++) {
+    htable_setop_bucket(op, i);
+  }
+
+  return NULL;
+}
+
+// Split the buckets between 'threads' threads, the caller being one of them. Adds up the threads' counts
+// in 'op'
+static void htable_setop_parallel(htable_setop *op, int threads)
+{
+  size_t cap = op->src->cap;
+
+  if (threads < 1 || cap == 0) {
+    threads = 1;
+  } else if ((size_t) threads > cap) {
+    threads = (int) cap;
+  }
+
+  htable_setop ops[threads];
+  pthread_t tids[threads];
+  bool started[threads];
+
+  for (int t = 0; t < threads; t++) {
+    ops[t] = *op;
+    ops[t].from = cap * t / threads;
+    ops[t].to = cap * (t + 1) / threads;
+    ops[t].added = 0;
+    ops[t].removed = 0;
+    ops[t].failed = false;
+    ops[t].spare = NULL;
+    started[t] = false;
+  }
+
+  for (int t = 1; t < threads; t++) {
+    started[t] = pthread_create(&tids[t], NULL, htable_setop_run, &ops[t]) == 0;
+  }
+
+  // Ranges which didn't get a thread run on the caller
+  for (int t = 0; t < threads; t++) {
+    if (!started[t]) {
+      htable_setop_run(&ops[t]);
+    }
+  }
+
+  for (int t = 0; t < threads; t++) {
+
+    if (started[t]) {
+      pthread_join(tids[t], NULL);
+    }
+
+    op->added += ops[t].added;
+    op->removed += ops[t].removed;
+    op->failed |= ops[t].failed;
+
+    for (htable_node *node = ops[t].spare, *next; node != NULL; node = next) {
+      next = node->next;
+      htable_node_destroy(op->src, node);
+    }
+
+  }
+}
+
+// Entry by entry merge, for tables which can't be merged bucket-wise. Nodes for the keys missing from dst
+// are reserved first, so either every entry moves or, returning false, none does
+static bool htable_merge_entries(htable *dst, htable *src, htable_conflict_fn conflict)
+{
+  // The caller holds src, so the iterator is used without locking
+  htable_itr itr = {NULL, src, 0, 0, 0};
+  htable_entry *entry = NULL;
+  size_t missing = 0;
+
+  while ((entry = htable_iterator_next(&itr)) != NULL) {
+    missing += htable_find_locked(dst, entry->key, hash_fn(entry->key)) == NULL;
+  }
+
+  if (!htable_node_reserve(dst, missing)) {
+    htable_node_trim(dst);
+    return false;
+  }
+
+  itr = (htable_itr) {NULL, src, 0, 0, 0};
+
+  while ((entry = htable_iterator_next(&itr)) != NULL) {
+
+    uint64_t hash = hash_fn(entry->key);
+    htable_entry *existing = htable_find_locked(dst, entry->key, hash);
+
+    if (existing != NULL) {
+      htable_store(existing->val, conflict == NULL ? entry->val : conflict(entry->key, existing->val, entry->val));
+      htable_log_append(dst, HTABLE_LOG_SET, entry->key, existing->val);
+    } else {
+      htable_insert_locked(dst, entry->key, hash, entry->val);
+      htable_log_append(dst, HTABLE_LOG_SET, entry->key, entry->val);
+    }
+
+    htable_log_append(src, HTABLE_LOG_REMOVE, entry->key, NULL);
+
+  }
+
+  htable_node_trim(dst);
+  htable_clear_locked(src);
+
+  return true;
+}
+
+// Create a table with the entries of 'a' which also are (intersect) or aren't (diff) in 'b'
+static htable *htable_filter(htable *a, htable *b, bool keep_common, int threads)
+{
+  htable *result;
+  bool failed = false;
+
+  if ((result = htable_init(a->alloc, a->dealloc, a->cap, a->flags)) == NULL) {
+    return NULL;
+  }
+
+  htable_read_lock_pair(a, b);
+
+  if (a->cap == b->cap && a->compacting != HTABLE_COMPACT_FOLD && b->compacting != HTABLE_COMPACT_FOLD) {
+
+    htable_setop op = {
+            .dst = result,
+            .src = a,
+            .other = b,
+            .keep_common = keep_common
+    };
+
+    htable_setop_parallel(&op, threads);
+    result->size = op.added;
+    failed = op.failed;
+
+  } else {
+
+    // The caller holds a, so the iterator is used without locking
+    htable_itr itr = {NULL, a, 0, 0, 0};
+    htable_entry *entry = NULL;
+
+    while ((entry = htable_iterator_next(&itr)) != NULL) {
+      uint64_t hash = hash_fn(entry->key);
+
+      if ((htable_find_locked(b, entry->key, hash) != NULL) == keep_common &&
+          !htable_insert_locked(result, entry->key, hash, entry->val)) {
+        failed = true;
+        break;
+      }
+    }
+
+  }
+
+  htable_read_unlock(a);
+
+  if (a != b) {
+    htable_read_unlock(b);
+  }
+
+  // The entries are still a's, destroying only releases the result's own memory
+  if (failed) {
+    htable_destroy(result);
+    return NULL;
+  }
+
+  return result;
+}
+
+
+// htable
+
+htable *htable_create(size_t size)
+{
+  return htable_create_with_allocator(calloc, free, size);
+}
+
+htable *htable_create_with_allocator(void *(*alloc)(size_t, size_t), void (*dealloc)(void *), size_t size)
+{
+  return htable_init(alloc, dealloc, size, 0);
+}
+
+htable *htable_create_with_flags(size_t size, unsigned int flags)
+{
+  return htable_init(calloc, free, size, flags);
+}
+
+void htable_destroy(htable *self)
+{
+  htable_log_stop(self);
+
+  // Free all elements of the table. Taking the lock as a writer applies, and frees, anything still queued
+  htable_write_lock(self);
+
+  for (size_t i = 0; i < self->cap; i++) {
+    if (self->flags & HTABLE_INLINE_BUCKETS) {
+      htable_chain_free(self, self->inline_buckets[i].overflow);
+    } else {
+      htable_chain_free(self, self->buckets[i]);
+    }
+  }
+
+  htable_chain_free(self, self->free_nodes);
+
+  while (self->arenas != NULL) {
+    htable_arena_free(self, &self->arenas);
+  }
+
+  for (htable_retired *retired = self->retired, *next_retired; retired != NULL; retired = next_retired) {
+    next_retired = retired->next;
+    self->dealloc(retired->mem);
+    self->dealloc(retired);
+  }
+
+  pthread_rwlock_unlock(&self->mu);
+
+  pthread_rwlock_destroy(&self->mu);
+  if (self->flags & HTABLE_INLINE_BUCKETS) {
+    self->dealloc(self->inline_mem);
+  } else {
+    self->dealloc(self->buckets);
+  }
+
+  self->dealloc(self);
+}
+
+int htable_size(htable *self)
+{
+  return self->size;
+}
+
+void htable_set(htable *self, const char *key, void *val)
+{
+  uint64_t hash = hash_fn(key);
+
+  htable_write_lock(self);
+  htable_set_locked(self, key, hash, val);
+  htable_write_unlock(self);
+}
+
+void htable_set_async(htable *self, const char *key, void *val)
+{
+  if (!htable_enqueue(self, key, hash_fn(key), val, false)) {
+    htable_set(self, key, val);
+    return;
+  }
+
+  htable_combine(self);
+}
+
+void *htable_get(htable *self, const char *key)
+{
+  uint64_t hash = hash_fn(key);
+  htable_entry found = {NULL, NULL};
+  htable_cache_entry *cached = NULL;
+  size_t seq = 0;
+
+  if (self->flags & HTABLE_THREAD_CACHE) {
+    cached = &htable_cache[htable_cache_index(hash)];
+
+    if (htable_cache_get(self, cached, key, hash)) {
+      return cached->val;
+    }
   }
 
-  node->entry.key = key;
-  node->entry.val = val;
-  node->next = NULL;
+  if (self->flags & HTABLE_OPTIMISTIC) {
 
-  return node;
+    seq = htable_get_optimistic(self, key, hash, &found);
+
+  } else {
+
+    pthread_rwlock_rdlock(&self->mu);
+
+    htable_entry *entry = htable_find_locked(self, key, hash);
+
+    if (entry != NULL) {
+      found = *entry;
+    }
+
+    seq = self->seq;
+
+    htable_read_unlock(self);
+
+  }
+
+  // The caller's key equals the one found, and unlike it can't be freed meanwhile
+  if (cached != NULL && found.key != NULL) {
+    size_t len = strlen(key);
+
+    *cached = (htable_cache_entry) {self->id, seq, hash, found.key, found.val, len < HTABLE_CACHE_KEY, {0}};
+
+    if (cached->copied) {
+      memcpy(cached->copy, key, len + 1);
+    }
+  }
+
+  return found.val;
 }
 
-static void htable_node_destroy(htable *self, htable_node *node)
+void *htable_remove(htable *self, const char *key)
 {
-  self->dealloc(node);
+  uint64_t hash = hash_fn(key);
+  void *value = NULL;
+
+  htable_write_lock(self);
+  value = htable_remove_locked(self, key, hash);
+  htable_write_unlock(self);
+
+  return value;
 }
 
-static htable_node *htable_iterator_next_node(htable_itr *itr)
+void htable_remove_async(htable *self, const char *key)
 {
-  // Get the next element in the table. If there are no more elements, then null is returned
-  htable_node *node = NULL;
+  if (!htable_enqueue(self, key, hash_fn(key), NULL, true)) {
+    htable_remove(self, key);
+    return;
+  }
 
-  // Get entry linked to the current
-  if (itr->node != NULL && itr->node->next != NULL) {
+  htable_combine(self);
+}
 
-    node = itr->node->next;
-    itr->node = itr->node->next;
+void htable_flush(htable *self)
+{
+  // Taking the write lock applies everything queued. Even with an empty queue the lock has to be
+  // taken, since another thread may still be applying operations it took off the queue
+  htable_write_lock(self);
+  htable_write_unlock(self);
+}
 
-  } else {
+void htable_resize(htable *self, size_t size)
+{
+  if (self->flags & HTABLE_INLINE_BUCKETS) {
+    htable_resize_inline(self, size);
+    return;
+  }
 
-    // Get entry from the next bucket
-    while (node == NULL && itr->next_bucket < itr->tab->cap) {
+  htable_node **buckets;
 
-      if (itr->tab->buckets[itr->next_bucket] != NULL) {
-        node = itr->tab->buckets[itr->next_bucket];
-      }
+  if ((buckets = self->alloc(size, sizeof(htable_node *))) == NULL) {
+    return;
+  }
 
-      itr->next_bucket++;
+  htable_write_lock(self);
+
+  // Relink every node into the new array. Nodes keep their hash, so nothing is rehashed or reallocated
+  for (size_t i = 0; i < self->cap; i++) {
 
+    htable_node *next = NULL;
+
+    for (htable_node *node = self->buckets[i]; node != NULL; node = next) {
+      size_t bucket = htable_index(node->hash, size);
+
+      next = node->next;
+      htable_store(node->next, buckets[bucket]);
+      buckets[bucket] = node;
     }
 
-    // If there are no linked entries and no more buckets, the iterator is finished
   }
 
-  return node;
-}
+  // Free old bucket array
+  htable_retire(self, self->buckets, self->cap * sizeof(htable_node *));
 
+  htable_store(self->buckets, buckets);
+  htable_store(self->cap, size);
+  htable_compact_end(self);
 
-// htable
+  htable_write_unlock(self);
+}
 
-htable *htable_create(size_t size)
+int htable_compact(htable *self, size_t budget)
 {
-  return htable_create_with_allocator(calloc, free, size);
+  htable_compact_mem mem = {NULL, 0, 0, false, false, NULL};
+  size_t done = 0;
+  bool waiting = false;
+  int more = 0;
+
+  // Nothing to do if the table wasn't written since the last compaction finished. Checked before
+  // locking, since taking the write lock invalidates every thread's cached lookups
+  if (htable_load(self->compact_seq) == htable_load(self->seq) && htable_load(self->pending) == NULL) {
+    return 0;
+  }
+
+  // Always make progress, even without a budget
+  if (budget == 0) {
+    budget = 1;
+  }
+
+  htable_write_lock(self);
+
+  // Steps needing memory release the lock while it's allocated, like htable_resize() does
+  do {
+
+    // Also restarts a compaction cancelled while the lock was released
+    if (self->compacting == HTABLE_COMPACT_IDLE) {
+      htable_compact_start(self);
+    }
+
+    for (size_t visited = 1; done < budget && self->compacting != HTABLE_COMPACT_IDLE && visited > 0; done += visited) {
+      visited = htable_compact_step(self, &mem);
+      waiting = visited == 0;
+    }
+
+    if ((more = self->compacting != HTABLE_COMPACT_IDLE) == 0) {
+      // The sequence the table has once unlocked
+      htable_store(self->compact_seq, self->seq + 1);
+    }
+
+    htable_write_unlock(self);
+
+    if (mem.block != NULL) {
+      self->dealloc(mem.block);
+      mem.block = NULL;
+    }
+
+    if (mem.garbage != NULL) {
+      self->dealloc(mem.garbage);
+      mem.garbage = NULL;
+    }
+
+    if (!waiting || mem.stalled) {
+      break;
+    }
+
+    mem.failed = (mem.block = self->alloc(mem.count, mem.size)) == NULL;
+    waiting = false;
+
+    htable_write_lock(self);
+
+  } while (true);
+
+  return more;
 }
 
-htable *htable_create_with_allocator(void *(*alloc)(size_t, size_t), void (*dealloc)(void *), size_t size)
+size_t htable_memory(htable *self)
 {
-  htable *self;
+  size_t bytes = sizeof(htable);
+  size_t nodes = 0;
 
-  if ((self = alloc(1, sizeof(htable))) == NULL) {
-    return NULL;
+  pthread_rwlock_rdlock(&self->mu);
+
+  if (self->flags & HTABLE_INLINE_BUCKETS) {
+    bytes += (self->cap + 1) * sizeof(htable_bucket);
+  } else {
+    bytes += self->cap * sizeof(htable_node *);
   }
 
-  if ((self->buckets = alloc(size, sizeof(htable_node *))) == NULL) {
-    dealloc(self);
-    return NULL;
+  // Nodes relocated into arenas are counted with their arena
+  for (size_t i = 0; i < self->cap; i++) {
+    htable_node *node = self->flags & HTABLE_INLINE_BUCKETS ? self->inline_buckets[i].overflow : self->buckets[i];
+
+    for (; node != NULL; node = node->next) {
+      if (self->arenas == NULL || htable_arena_of(self, node) == NULL) {
+        nodes++;
+      }
+    }
   }
 
-  self->alloc = alloc;
-  self->dealloc = dealloc;
-  self->size = 0;
-  self->cap = size;
+  for (htable_node *node = self->free_nodes; node != NULL; node = node->next) {
+    nodes++;
+  }
 
-  pthread_rwlock_init(&self->mu, NULL);
+  bytes += nodes * sizeof(htable_node);
 
-  return self;
+  for (htable_arena *arena = self->arenas; arena != NULL; arena = arena->next) {
+    bytes += sizeof(htable_arena) + arena->cap * sizeof(htable_node);
+  }
+
+  for (htable_retired *retired = self->retired; retired != NULL; retired = retired->next) {
+    bytes += sizeof(htable_retired) + retired->size;
+  }
+
+  if (self->log != NULL) {
+    bytes += sizeof(htable_log) + self->log->cap;
+  }
+
+  htable_read_unlock(self);
+
+  return bytes;
 }
 
-void htable_destroy(htable *self)
+
+int htable_merge(htable *dst, htable *src, htable_conflict_fn conflict, int threads)
 {
-  // Free all elements of the table
-  htable_itr itr = htable_iterator_mut(self);
-  htable_node *node = NULL;
+  bool merged = true;
 
-  while ((node = htable_iterator_next_node(&itr)) != NULL) {
-    htable_node_destroy(self, node);
+  if (dst == src) {
+    return 0;
   }
 
-  htable_iterator_destroy(&itr);
+  htable_write_lock_pair(dst, src);
 
-  pthread_rwlock_destroy(&self->mu);
-  self->dealloc(self->buckets);
-  self->dealloc(self);
+  // The log ring takes one producer at a time
+  if (dst->log != NULL || src->log != NULL) {
+    threads = 1;
+  }
+
+  // Nodes can only move between tables sharing a layout and an allocator, and not out of src's arenas. A
+  // node moved out of an optimistic table may still be read through it, so dst must not free it either.
+  // Buckets only line up while neither table is folding its array
+  if (dst->cap == src->cap && (dst->flags & HTABLE_INLINE_BUCKETS) == (src->flags & HTABLE_INLINE_BUCKETS) &&
+      (dst->flags & HTABLE_OPTIMISTIC) == (src->flags & HTABLE_OPTIMISTIC) && dst->alloc == src->alloc &&
+      dst->dealloc == src->dealloc && src->arenas == NULL && dst->compacting != HTABLE_COMPACT_FOLD &&
+      src->compacting != HTABLE_COMPACT_FOLD) {
+
+    htable_setop op = {
+            .dst = dst,
+            .src = src,
+            .conflict = conflict,
+            .merge = true
+    };
+
+    htable_setop_parallel(&op, threads);
+    dst->size += op.added;
+    src->size -= op.removed;
+    merged = !op.failed;
+
+  } else {
+
+    merged = htable_merge_entries(dst, src, conflict);
+
+  }
+
+  htable_write_unlock(src);
+  htable_write_unlock(dst);
+
+  return merged ? 0 : -1;
 }
 
-int htable_size(htable *self)
+htable *htable_diff(htable *a, htable *b, int threads)
 {
-  return self->size;
+  return htable_filter(a, b, false, threads);
 }
 
-void htable_set(htable *self, const char *key, void *val)
+htable *htable_intersect(htable *a, htable *b, int threads)
 {
-  uint64_t hash = hash_fn(key);
-  size_t bucket = (size_t) (hash & self->cap - 1);
+  return htable_filter(a, b, true, threads);
+}
 
-  pthread_rwlock_wrlock(&self->mu);
 
-  htable_node *node = self->buckets[bucket];
+htable_cache_stats htable_thread_cache_stats(void)
+{
+  return htable_cache_counters;
+}
 
-  if (node == NULL) {
 
-    // Create new entry in bucket
-    self->buckets[bucket] = htable_node_create(self, key, val);;
-    self->size++;
+// htable_log
 
-  } else {
+int htable_log_start(htable *self, int fd, size_t ring_size, htable_log_encode_fn encode)
+{
+  htable_log *log;
+  size_t cap = HTABLE_LOG_MIN_RING;
 
-    bool is_set = false;
+  // The ring wraps by masking, so its size is a power of two
+  while (cap < ring_size) {
+    cap <<= 1;
+  }
 
-    // Iterate through the list and find a matching entry
-    for (; node->next; node = node->next) {
-      if (strcmp(node->entry.key, key) == 0) {
-        node->entry.val = val;
-        is_set = true;
-        break;
-      }
-    }
+  if ((log = self->alloc(1, sizeof(htable_log))) == NULL) {
+    return -1;
+  }
 
-    // If no entry was found, create a new one at the end of the list
-    if (!is_set) {
-      if (strcmp(node->entry.key, key) == 0) {
-        node->entry.val = val;
-      } else {
-        node->next = htable_node_create(self, key, val);;
-        self->size++;
-      }
-    }
+  if ((log->ring = self->alloc(cap, 1)) == NULL) {
+    self->dealloc(log);
+    return -1;
+  }
 
+  log->cap = cap;
+  log->head = 0;
+  log->tail = 0;
+  log->fd = fd;
+  log->error = 0;
+  log->dropped = 0;
+  log->stop = 0;
+  log->waiters = 0;
+  log->encode = encode;
+
+  if (pthread_create(&log->flusher, NULL, htable_log_flusher, log) != 0) {
+    self->dealloc(log->ring);
+    self->dealloc(log);
+    return -1;
   }
 
-  pthread_rwlock_unlock(&self->mu);
+  htable_write_lock(self);
+
+  if (self->log == NULL) {
+    self->log = log;
+    log = NULL;
+  }
+
+  htable_write_unlock(self);
+
+  // Another log was already attached
+  if (log != NULL) {
+    htable_store(log->stop, 1);
+    pthread_join(log->flusher, NULL);
+    self->dealloc(log->ring);
+    self->dealloc(log);
+    return -1;
+  }
+
+  return 0;
 }
 
-void *htable_get(htable *self, const char *key)
+int htable_log_stop(htable *self)
 {
-  uint64_t hash = hash_fn(key);
-  size_t bucket = (size_t) (hash & self->cap - 1);
+  htable_log *log;
+  int error;
 
-  pthread_rwlock_rdlock(&self->mu);
+  // Detach the log first, so nothing is appended while the flusher drains the ring
+  htable_write_lock(self);
+  log = self->log;
+  self->log = NULL;
+  htable_write_unlock(self);
 
-  htable_node *node = self->buckets[bucket];
+  if (log == NULL) {
+    return 0;
+  }
 
-  // Check each element in the bucket for a key match. The loop will terminate
-  // when the reach the end or we find an entry with a matching key
-  for (; node != NULL && strcmp(node->entry.key, key) != 0; node = node->next);
+  htable_store(log->stop, 1);
+  pthread_join(log->flusher, NULL);
 
-  pthread_rwlock_unlock(&self->mu);
-  return node == NULL ? NULL : node->entry.val;
+  // The flusher drained the ring, so whoever is still in htable_log_flush() is about to leave
+  while (htable_load(log->waiters) > 0) {
+    sched_yield();
+  }
+
+  error = htable_log_errno(log);
+
+  self->dealloc(log->ring);
+  self->dealloc(log);
+
+  if (error != 0) {
+    errno = error;
+    return -1;
+  }
+
+  return 0;
 }
 
-void *htable_remove(htable *self, const char *key)
+int htable_log_flush(htable *self)
 {
-  uint64_t hash = hash_fn(key);
-  size_t bucket = (size_t) (hash & self->cap - 1);
-  void *value = NULL;
+  htable_log *log;
+  size_t head;
+  int error;
 
-  pthread_rwlock_wrlock(&self->mu);
+  // Register under the lock, so htable_log_stop() keeps the log around, then wait without it
+  pthread_rwlock_rdlock(&self->mu);
 
-  htable_node *node = self->buckets[bucket];
+  if ((log = self->log) != NULL) {
+    __atomic_fetch_add(&log->waiters, 1, __ATOMIC_ACQ_REL);
+    head = log->head;
+  }
 
-  if (node != NULL) {
+  htable_read_unlock(self);
 
-    if (strcmp(node->entry.key, key) == 0) {
+  if (log == NULL) {
+    return 0;
+  }
 
-      htable_node *next = node->next;
-      value = node->entry.val;
-      htable_node_destroy(self, node);
-      self->size--;
+  while (htable_load(log->tail) < head) {
+    sched_yield();
+  }
 
-      // If there is another element in the bucket, move it up
-      if (next != NULL) {
-        self->buckets[bucket] = next;
-      } else {
-        self->buckets[bucket] = NULL;
-      }
+  error = htable_log_errno(log);
 
-    } else {
+  __atomic_fetch_sub(&log->waiters, 1, __ATOMIC_ACQ_REL);
 
-      // Find matching entry and connect previous entry to it
-      node = node->next;
-      htable_node *last = node;
+  if (error != 0) {
+    errno = error;
+    return -1;
+  }
 
-      while (node != NULL && strcmp(node->entry.key, key) != 0) {
+  return 0;
+}
 
-        last = node;
-        node = node->next;
+size_t htable_log_dropped(htable *self)
+{
+  size_t dropped = 0;
 
-      }
+  pthread_rwlock_rdlock(&self->mu);
 
-      // If entry is not null, reconnect last to next and free the entry
-      if (node != NULL) {
-        last->next = node->next;
-        value = node->entry.val;
-        htable_node_destroy(self, node);
-        self->size--;
-      }
+  if (self->log != NULL) {
+    dropped = self->log->dropped;
+  }
 
-    }
+  htable_read_unlock(self);
+
+  return dropped;
+}
 
+int htable_snapshot(htable *self, int fd, htable_log_encode_fn encode)
+{
+  FILE *out;
+  int copy;
+  bool ok = true;
+
+  // Buffer through stdio, on a copy of the descriptor so closing the stream leaves the caller's open
+  if ((copy = dup(fd)) < 0) {
+    return -1;
   }
 
-  pthread_rwlock_unlock(&self->mu);
-  return value;
+  if ((out = fdopen(copy, "w")) == NULL) {
+    close(copy);
+    return -1;
+  }
+
+  htable_itr itr = htable_iterator(self);
+  htable_entry *entry = NULL;
+
+  while (ok && (entry = htable_iterator_next(&itr)) != NULL) {
+    const void *data = NULL;
+    uint32_t val_len = htable_log_value(encode, entry->val, &data);
+
+    // Replay rejects anything longer
+    ok = strlen(entry->key) <= HTABLE_LOG_MAX_FIELD && val_len <= HTABLE_LOG_MAX_FIELD &&
+         htable_write_record(out, HTABLE_LOG_SET, entry->key, data, val_len);
+  }
+
+  htable_iterator_destroy(&itr);
+
+  if (fclose(out) != 0) {
+    ok = false;
+  }
+
+  return ok ? 0 : -1;
 }
 
-void htable_resize(htable *self, size_t size)
+long htable_replay(htable *self, int fd, htable_log_decode_fn decode)
 {
-  htable *resized = htable_create_with_allocator(self->alloc, self->dealloc, size);
-  htable_itr itr = htable_iterator_mut(self);
-  htable_node *node = NULL;
+  FILE *in;
+  int copy;
+  long records = 0;
+  char header[HTABLE_LOG_HEADER];
+  bool corrupt = false;
+
+  if ((copy = dup(fd)) < 0) {
+    return -1;
+  }
+
+  if ((in = fdopen(copy, "r")) == NULL) {
+    close(copy);
+    return -1;
+  }
 
-  // Iterate all entries
-  while ((node = htable_iterator_next_node(&itr)) != NULL) {
-    htable_set(resized, node->entry.key, node->entry.val);
+  htable_write_lock(self);
+
+  while (fread(header, 1, HTABLE_LOG_HEADER, in) == HTABLE_LOG_HEADER) {
+
+    uint32_t key_len, val_len;
+    char *key = NULL;
+    char *data = NULL;
+    void *val = NULL;
+
+    memcpy(&key_len, header + 1, sizeof(key_len));
+    memcpy(&val_len, header + 5, sizeof(val_len));
+
+    // Operations and lengths no writer produces would have us guess, or allocate whatever the stream claims
+    if ((header[0] != HTABLE_LOG_SET && header[0] != HTABLE_LOG_REMOVE) || key_len > HTABLE_LOG_MAX_FIELD ||
+        val_len > HTABLE_LOG_MAX_FIELD) {
+      corrupt = true;
+      break;
+    }
+
+    // Zeroed by the allocator, so both come out terminated
+    key = self->alloc((size_t) key_len + 1, 1);
+    data = self->alloc((size_t) val_len + 1, 1);
+
+    // A record cut short is where the writer stopped, not an error
+    if (key == NULL || data == NULL || fread(key, 1, key_len, in) != key_len || fread(data, 1, val_len, in) != val_len) {
+      self->dealloc(key);
+      self->dealloc(data);
+      break;
+    }
+
+    if (header[0] == HTABLE_LOG_SET) {
+      if (decode != NULL) {
+        val = decode(data, val_len);
+        self->dealloc(data);
+      } else {
+        val = data;
+      }
+    } else {
+      self->dealloc(data);
+    }
+
+    htable_replay_record(self, header[0], key, val);
+    records++;
 
-    // Free old node
-    htable_node_destroy(self, node);
   }
 
-  // Free old bucket array
-  self->dealloc(self->buckets);
+  htable_write_unlock(self);
 
-  // Reassign resized to self
-  self->buckets = resized->buckets;
-  self->size = resized->size;
-  self->cap = resized->cap;
+  if (ferror(in) || corrupt) {
+    records = -1;
+  }
 
-  // Free temporary table
-  self->dealloc(resized);
+  fclose(in);
 
-  htable_iterator_destroy(&itr);
+  return records;
 }
 
 
@@ -277,6 +2403,8 @@ htable_itr htable_iterator(htable *self)
   return (htable_itr) {
           NULL,
           self,
+          0,
+          0,
           0
   };
 }
@@ -284,46 +2412,33 @@ htable_itr htable_iterator(htable *self)
 htable_itr htable_iterator_mut(htable *self)
 {
   // Lock the table for writing. htable_iterator_close must be called to unlock the mutex
-  pthread_rwlock_wrlock(&self->mu);
+  htable_write_lock(self);
 
   return (htable_itr) {
           NULL,
           self,
-          0
+          0,
+          0,
+          1
   };
 }
 
 htable_entry *htable_iterator_next(htable_itr *itr)
 {
-  // Get the next element in the table. If there are no more elements, then null is returned
-  htable_node *node = NULL;
-
-  // Get entry linked to the current
-  if (itr->node != NULL && itr->node->next != NULL) {
-
-    node = itr->node->next;
-    itr->node = itr->node->next;
-
-  } else {
-
-    // Get entry from the next bucket
-    while (node == NULL && itr->next_bucket < itr->tab->cap) {
-
-      if (itr->tab->buckets[itr->next_bucket] != NULL) {
-        node = itr->tab->buckets[itr->next_bucket];
-      }
-
-      itr->next_bucket++;
-
-    }
-
-    // If there are no linked entries and no more buckets, the iterator is finished
+  if (itr->tab->flags & HTABLE_INLINE_BUCKETS) {
+    return htable_iterator_next_inline(itr);
   }
 
+  htable_node *node = htable_iterator_next_node(itr);
+
   return node == NULL ? NULL : &node->entry;
 }
 
 void htable_iterator_destroy(htable_itr *itr)
 {
-  pthread_rwlock_unlock(&itr->tab->mu);
+  if (itr->mut) {
+    htable_write_unlock(itr->tab);
+  } else {
+    htable_read_unlock(itr->tab);
+  }
 }
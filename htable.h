@@ -3,11 +3,37 @@
 
 
 #include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 
 
 #define FNV_OFFSET 14695981039346656037UL
 #define FNV_PRIME 1099511628211UL
 
+// Flags accepted by htable_create_with_flags()
+//
+// HTABLE_OPTIMISTIC: htable_get() does not take the read lock. Readers snapshot the table's write
+// sequence, perform the lookup and retry if a writer ran concurrently. Writers still serialize on the
+// write lock. Meant for small, read-mostly tables where the lock costs more than the lookup itself.
+#define HTABLE_OPTIMISTIC 0x1
+
+// HTABLE_INLINE_BUCKETS: each bucket is a cache line holding the first HTABLE_BUCKET_SLOTS entries inline,
+// so most lookups touch a single line instead of the array plus a separately allocated node. Uses 64 bytes
+// per bucket instead of 8, so size the table close to the number of entries.
+#define HTABLE_INLINE_BUCKETS 0x2
+
+#define HTABLE_BUCKET_SLOTS 3
+
+// HTABLE_THREAD_CACHE: htable_get() first checks a small direct-mapped cache private to the calling thread.
+// A hit costs one hash and one key comparison, without touching the lock or writing shared memory. Any
+// write to the table invalidates every thread's cached entries for it, so this pays off for skewed,
+// read-mostly access. Only keys shorter than HTABLE_CACHE_KEY, or looked up through the pointer the table
+// stores, can hit. See htable_thread_cache_stats() for the hit rate.
+#define HTABLE_THREAD_CACHE 0x4
+
+#define HTABLE_CACHE_SLOTS 256
+#define HTABLE_CACHE_KEY 16
+
 
 typedef struct htable_entry
 {
@@ -18,28 +44,144 @@ typedef struct htable_entry
 typedef struct htable_node
 {
   htable_entry entry;
+  uint64_t hash; // Full hash of the key, compared before the key itself
   struct htable_node *next;
 } htable_node;
 
+// A bucket of an HTABLE_INLINE_BUCKETS table, exactly one cache line
+typedef struct htable_bucket
+{
+  uint16_t tags[HTABLE_BUCKET_SLOTS];       // Top bits of the hash of each slot's key, 0 when the slot is empty
+  htable_entry slots[HTABLE_BUCKET_SLOTS];
+  struct htable_node *overflow;             // Entries which didn't fit in the slots
+} __attribute__((aligned(64))) htable_bucket;
+
+_Static_assert(sizeof(htable_bucket) == 64, "htable_bucket must fill exactly one cache line");
+
+// Memory which can't be released while the table is alive, because optimistic readers may still be
+// reading it. Released in htable_destroy()
+typedef struct htable_retired
+{
+  void *mem;
+  size_t size; // Bytes at mem
+  struct htable_retired *next;
+} htable_retired;
+
+// A block of nodes relocated by htable_compact(), laid out in bucket order. Nodes in it are released
+// by counting them, the block goes once none is left in the table
+typedef struct htable_arena
+{
+  htable_node *nodes;
+  size_t cap;  // Number of nodes in the block
+  size_t used; // Nodes handed out so far
+  size_t live; // Nodes still in the table
+  struct htable_arena *next;
+} htable_arena;
+
+// A mutation queued by htable_set_async() or htable_remove_async()
+typedef struct htable_op
+{
+  const char *key;
+  uint64_t hash;
+  void *val;
+  int remove;
+  struct htable_op *next;
+} htable_op;
+
+// An entry of the per-thread lookup cache. The table's key may be freed as soon as it's removed, so it's
+// only ever compared by address. Keys shorter than HTABLE_CACHE_KEY are also copied for comparing
+typedef struct htable_cache_entry
+{
+  uint64_t id;    // Table the entry belongs to
+  size_t seq;     // Write sequence of the table when the entry was filled
+  uint64_t hash;
+  const char *key;
+  void *val;
+  bool copied;    // Whether copy holds the whole key
+  char copy[HTABLE_CACHE_KEY];
+} htable_cache_entry;
+
+// Lookup cache counters of the calling thread, across all tables
+typedef struct htable_cache_stats
+{
+  uint64_t hits;
+  uint64_t misses;
+} htable_cache_stats;
+
+// Encodes a value for the mutation log. Points 'data' at the bytes to log and returns how many there are
+typedef size_t (*htable_log_encode_fn)(const void *val, const void **data);
+
+// Rebuilds a logged value in htable_replay(). The value must come from the table's allocator
+typedef void *(*htable_log_decode_fn)(const void *data, size_t len);
+
+// Mutation log attached by htable_log_start(). Writers append records to the ring while holding the
+// write lock, a background thread writes them out. Writers never wait for it, records which don't fit
+// are dropped and counted instead
+typedef struct htable_log
+{
+  char *ring;
+  size_t cap;  // Size of the ring, a power of two
+  size_t head; // Total bytes appended, only written by the thread holding the write lock
+  size_t tail; // Total bytes written out, only written by the flusher
+  int fd;
+  int error;   // errno of the first failed write, if any
+  size_t dropped; // Records dropped once the ring overflowed, only written under the write lock
+  int stop;
+  int waiters; // Threads in htable_log_flush(), which htable_log_stop() waits out before freeing the log
+  pthread_t flusher;
+  htable_log_encode_fn encode;
+} htable_log;
+
 typedef struct htable
 {
   size_t size; // Number of entries currently stored in the table
 
   htable_node **buckets; // Main array. Each bucket is a linked list
   size_t cap;            // Capacity of the array
+
+  // Main array of HTABLE_INLINE_BUCKETS tables, used instead of buckets. inline_mem is the unaligned
+  // allocation it lives in
+  htable_bucket *inline_buckets;
+  void *inline_mem;
   pthread_rwlock_t mu;   // read/write mutex
 
+  unsigned int flags; // HTABLE_* flags the table was created with
+  size_t seq;         // Write sequence. Odd while a writer holds the table, bumped twice per write
+  uint64_t id;        // Unique for the process, identifies the table in lookup caches
+
+  // Only used with HTABLE_OPTIMISTIC. Removed nodes are kept for reuse instead of being freed, so
+  // a reader still traversing one never touches released memory
+  htable_node *free_nodes;
+  htable_retired *retired;
+
+  htable_op *pending; // Queued mutations not yet applied, newest first
+  htable_log *log;    // Mutation log, if one was started
+
+  // Progress of htable_compact(). While folding, buckets below compact_next hold every entry whose hash
+  // indexes them at compact_cap, the capacity being shrunk to. While relocating, compact_next is the next
+  // bucket to relocate and compact_cap equals cap. Otherwise compact_next is 0 and compact_cap equals cap
+  int compacting;       // Phase of the running compaction, 0 if there is none
+  size_t compact_cap;
+  size_t compact_next;
+  size_t compact_seq;   // Write sequence when the last compaction finished
+  htable_arena *arenas; // Relocated nodes, the one a running compaction fills first
+
   // Functions for allocation and deallocation. If not defined in create_with_allocator,
   // it will default to malloc and free
   void *(*alloc)(size_t, size_t);
   void (*dealloc)(void *);
 } htable;
 
+// Decides the value htable_merge() keeps for a key present in both tables
+typedef void *(*htable_conflict_fn)(const char *key, void *dst_val, void *src_val);
+
 typedef struct htable_itr
 {
   htable_node *node; // The current entry
   htable *tab;         // Reference to the original table, used to lock and unlock read mutex
   size_t next_bucket;  // Current bucket the iterator is pointing at
+  int slot;            // Next inline slot of the current bucket, HTABLE_INLINE_BUCKETS only
+  int mut;             // Whether the iterator holds the write lock
 } htable_itr;
 
 
@@ -56,6 +198,9 @@ htable *htable_create(size_t size);
 // functions will be used for all memory operations
 htable *htable_create_with_allocator(void *(*alloc)(size_t, size_t), void (*dealloc)(void *), size_t size);
 
+// Create a new htable using the given HTABLE_* flags
+htable *htable_create_with_flags(size_t size, unsigned int flags);
+
 // Destroy the htable and free all resources
 // This will also attempt to free all values stored in the table
 void htable_destroy(htable *self);
@@ -67,6 +212,9 @@ int htable_size(htable *self);
 void htable_set(htable *self, const char *key, void *val);
 
 // Get the value stored with 'key'. If the key does not exist, then a null pointer is returned.
+//
+// With HTABLE_OPTIMISTIC the lookup runs without locking. Since a reader may still be comparing
+// against a key which is being removed, keys must stay valid until the table is destroyed.
 void *htable_get(htable *self, const char *key);
 
 // Remove the value stored with 'key', if it exists. If the value does exist, then it will be freed
@@ -74,6 +222,21 @@ void *htable_get(htable *self, const char *key);
 // is the proper way to regain ownership of the value
 void *htable_remove(htable *self, const char *key);
 
+// Queue setting 'key' to 'val' without waiting for the write lock
+//
+// If no other thread holds the table, the caller applies its own operation along with everything
+// else queued under a single write lock acquisition. Otherwise it returns immediately and the operation
+// is applied by whichever thread holds the table once it releases it. Until then htable_get() may not see
+// it, use htable_flush() when the caller needs to read its own writes.
+void htable_set_async(htable *self, const char *key, void *val);
+
+// Queue removing 'key' without waiting for the write lock, like htable_set_async(). The removed value
+// is not returned, so the caller must be able to release it through some other reference
+void htable_remove_async(htable *self, const char *key);
+
+// Apply all queued operations. Every operation queued before the call is visible once it returns
+void htable_flush(htable *self);
+
 // Resizes the table to the specified size
 //
 // This will not remove elements, only change the size of the underlying array. Choosing a size smaller
@@ -81,6 +244,104 @@ void *htable_remove(htable *self, const char *key);
 // htable_size to determine a good new size first
 void htable_resize(htable *self, size_t size);
 
+// Do at most 'budget' steps, at least one, of shrinking the table to fit its entries. Returns 1 while
+// there's work left, 0 once the table is compact
+//
+// The array is shrunk to the smallest power of two holding htable_size() entries, then each bucket's
+// chain is copied into one block of memory in bucket order, so chains and iteration walk memory
+// sequentially. A step is one bucket or one entry, done under the write lock, while memory is allocated
+// and released without holding it. Compacting a large table in the background so only ever blocks
+// other threads for a short while. Calling htable_resize() cancels a running compaction. Unless the array
+// shrinks, nodes aren't copied again while at most an eighth of them are newer than the last copy and at
+// least half of the copied ones are left.
+//
+// Nodes are only relocated in tables without HTABLE_INLINE_BUCKETS or HTABLE_OPTIMISTIC, the latter
+// can't release memory while they're alive. Only arrays with a power of two capacity are shrunk.
+int htable_compact(htable *self, size_t budget);
+
+// Get the number of bytes allocated by the table itself, not counting keys, values and queued operations.
+// Walks the whole table
+size_t htable_memory(htable *self);
+
+
+// Get the lookup cache counters of the calling thread, for all HTABLE_THREAD_CACHE tables it has read
+htable_cache_stats htable_thread_cache_stats(void);
+
+
+// Set operations
+//
+// When both tables have the same capacity, these work bucket to bucket instead of looking up each entry,
+// and the buckets are split between 'threads' threads, the caller included. With more than one thread,
+// the allocator and conflict function must be thread safe. Tables of different capacities are handled
+// entry by entry on the calling thread.
+
+// Move every entry of 'src' into 'dst', leaving 'src' empty. For keys in both tables, 'conflict' is
+// called with both values and returns the value to keep. If 'conflict' is null the value from 'src' wins.
+//
+// Bucket-wise merging also needs both tables to use the same bucket layout, allocator and HTABLE_OPTIMISTIC
+// flag, and moves the nodes themselves instead of reallocating them
+//
+// Returns 0, or -1 if nodes for dst couldn't be allocated. No entry is lost either way: entries which
+// couldn't move stay in src. Merging entry by entry moves none of them then
+int htable_merge(htable *dst, htable *src, htable_conflict_fn conflict, int threads);
+
+// Create a new table with the entries of 'a' whose keys aren't in 'b'. The result has the capacity, flags and
+// allocator of 'a'. Returns a null pointer if the table or any of its entries can't be allocated
+//
+// A change set from 'old' to 'new' is htable_diff(new, old) for the added keys and htable_diff(old, new) for
+// the removed ones
+htable *htable_diff(htable *a, htable *b, int threads);
+
+// Create a new table with the entries of 'a' whose keys are also in 'b', keeping the values from 'a'.
+// Returns a null pointer like htable_diff()
+htable *htable_intersect(htable *a, htable *b, int threads);
+
+
+// htable_log
+
+// Start logging every mutation of the table to 'fd' as a stream of binary set/remove records
+//
+// Writers only copy the record into a ring buffer of 'ring_size' bytes while holding the write lock. A
+// background thread writes it out in batches. Writers never wait for it: once a record doesn't fit, because
+// the ring is full or the record is larger than the ring, it and every later record are dropped, and the
+// file ends with the last complete record before them. Size the ring for the largest burst expected.
+// Values are logged through 'encode', or as strings if it's null. Changes made through
+// htable_iterator_mut() aren't logged.
+//
+// Returns 0 on success, or -1 if the log couldn't be created or one is already running
+int htable_log_start(htable *self, int fd, size_t ring_size, htable_log_encode_fn encode);
+
+// Stop logging, once every record appended so far is written. Returns -1 with errno set if any write
+// failed, or to ENOBUFS if records were dropped, 0 otherwise
+int htable_log_stop(htable *self);
+
+// Wait until every record appended so far is written, without stopping the log. Returns -1 with errno
+// set if any write failed, or to ENOBUFS if records were dropped, 0 otherwise, and 0 if there's no log.
+// Writers aren't held up while waiting
+int htable_log_flush(htable *self);
+
+// Get the number of records dropped since the log was started, 0 if there's no log. Once one is dropped
+// the log can't be replayed past it, so a replica fed by it has to start over from a new log and
+// snapshot. Doesn't wait for the log
+size_t htable_log_dropped(htable *self);
+
+// Write every entry of the table to 'fd' as set records, in the log's format. Returns 0 on success, -1 on error
+//
+// Replaying a snapshot and then the log rebuilds the table, as long as the log was started before the
+// snapshot was taken
+int htable_snapshot(htable *self, int fd, htable_log_encode_fn encode);
+
+// Apply the records read from 'fd', a snapshot or a log, to the table. Values are rebuilt with 'decode',
+// or copied into a terminated buffer from the table's allocator if it's null
+//
+// Keys and values are allocated with the table's allocator and owned by the table from then on: replaying
+// a record which replaces or removes an entry releases the old key and value. With HTABLE_OPTIMISTIC,
+// removed keys are kept until the table is destroyed, as htable_get() requires. Replay into a table only
+// ever filled by replay. Returns the number of records applied, or -1 if reading failed or a record is
+// corrupt, keeping the records before it applied. A record cut short at the end of the stream ends the
+// replay. Keys and values longer than 1 GiB are never logged, so longer lengths count as corruption.
+long htable_replay(htable *self, int fd, htable_log_decode_fn decode);
+
 
 // htable_itr
 
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -148,36 +149,787 @@ void *read_write_remove_large(void *table)
   return NULL;
 }
 
+void *remove_resize_large(void *table)
+{
 
-int main()
+  clock_t start = clock();
+
+  for (clock_t t = clock() - start; t / CLOCKS_PER_SEC < 10; t = clock() - start) {
+
+    int i = rand() % 4096;
+    void *val = htable_remove((htable *) table, keys[i]);
+    writes_large++;
+    if (val != NULL) {
+      assert(*(int *) val == i);
+    }
+
+    // Resizing relinks every node while the other threads keep reading and writing
+    if (i % 512 == 0) {
+      htable_resize((htable *) table, i % 1024 == 0 ? 1024 : 4096);
+      writes_large++;
+    }
+
+  }
+
+  return NULL;
+}
+
+
+void *write_table_async(void *table)
+{
+  for (int i = 0; i < 4096; i++) {
+    htable_set_async((htable *) table, keys[i], values[i]);
+  }
+
+  return NULL;
+}
+
+void *read_table_async(void *table)
+{
+  for (int i = 0; i < 4096; i++) {
+    void *val = htable_get((htable *) table, keys[i]);
+    if (val != NULL) {
+      assert(*(int *) val == i);
+    }
+  }
+
+  return NULL;
+}
+
+void *set_async_value_3(void *table)
+{
+  htable_set_async((htable *) table, "key 1", value_3);
+  return NULL;
+}
+
+void *remove_async_key_1(void *table)
+{
+  htable_remove_async((htable *) table, "key 1");
+  return NULL;
+}
+
+void *remove_table_async(void *table)
+{
+  for (int i = 0; i < 4096; i++) {
+    htable_remove_async((htable *) table, keys[i]);
+  }
+
+  return NULL;
+}
+
+int conflicts = 0;
+
+void *keep_dst(const char *key, void *dst_val, void *src_val)
+{
+  (void) key;
+  (void) src_val;
+  __atomic_add_fetch(&conflicts, 1, __ATOMIC_RELAXED);
+  return dst_val;
+}
+
+void *read_table_repeat(void *table)
+{
+  for (int n = 0; n < 16; n++) {
+    read_table_async(table);
+  }
+
+  return NULL;
+}
+
+// Merge an optimistic table while it's read without locking, into tables with and without HTABLE_OPTIMISTIC.
+// Conflicting keys release nodes of src, and removing from dst afterwards releases the moved ones
+void test_merge_readers(unsigned int flags)
+{
+  for (int optimistic = 0; optimistic < 2; optimistic++) {
+    htable *src = htable_create_with_flags(1024, flags | HTABLE_OPTIMISTIC);
+    htable *dst = htable_create_with_flags(1024, optimistic ? flags | HTABLE_OPTIMISTIC : flags & ~HTABLE_OPTIMISTIC);
+    pthread_t readers[2];
+
+    for (int i = 0; i < 2048; i++) {
+      htable_set(src, keys[i], values[i]);
+      htable_set(dst, keys[i + 1024], values[i + 1024]);
+    }
+
+    pthread_create(&readers[0], NULL, read_table_repeat, (void *) src);
+    pthread_create(&readers[1], NULL, read_table_repeat, (void *) src);
+
+    htable_merge(dst, src, NULL, 1);
+
+    assert(htable_size(src) == 0);
+    assert(htable_size(dst) == 3072);
+
+    for (int i = 0; i < 3072; i++) {
+      assert(htable_remove(dst, keys[i]) == values[i]);
+    }
+
+    pthread_join(readers[0], NULL);
+    pthread_join(readers[1], NULL);
+
+    htable_destroy(src);
+    htable_destroy(dst);
+  }
+}
+
+void test_set_operations(unsigned int flags, size_t cap_b, int threads)
+{
+  htable *a = htable_create_with_flags(1024, flags);
+  htable *b = htable_create_with_flags(cap_b, flags);
+
+  // a holds keys 0 - 2047, b holds keys 1024 - 3071
+  for (int i = 0; i < 2048; i++) {
+    htable_set(a, keys[i], values[i]);
+    htable_set(b, keys[i + 1024], values[i + 1024]);
+  }
+
+  htable *diff = htable_diff(a, b, threads);
+  assert(diff != NULL);
+  assert(htable_size(diff) == 1024);
+  for (int i = 0; i < 1024; i++) {
+    assert(htable_get(diff, keys[i]) == values[i]);
+    assert(htable_get(diff, keys[i + 1024]) == NULL);
+  }
+
+  htable *common = htable_intersect(a, b, threads);
+  assert(common != NULL);
+  assert(htable_size(common) == 1024);
+  for (int i = 0; i < 1024; i++) {
+    assert(htable_get(common, keys[i]) == NULL);
+    assert(htable_get(common, keys[i + 1024]) == values[i + 1024]);
+  }
+
+  // Conflicts keep the value already in a
+  conflicts = 0;
+  htable_set(b, keys[1024], value_1);
+  assert(htable_merge(a, b, keep_dst, threads) == 0);
+
+  assert(conflicts == 1024);
+  assert(htable_size(a) == 3072);
+  assert(htable_size(b) == 0);
+  for (int i = 0; i < 3072; i++) {
+    assert(htable_get(a, keys[i]) == values[i]);
+    assert(htable_get(b, keys[i]) == NULL);
+  }
+
+  // Without a conflict function the value from src wins
+  htable_set(b, keys[0], value_1);
+  assert(htable_merge(a, b, NULL, threads) == 0);
+  assert(htable_get(a, keys[0]) == value_1);
+  assert(htable_size(a) == 3072);
+  assert(htable_size(b) == 0);
+
+  htable_destroy(a);
+  htable_destroy(b);
+  htable_destroy(diff);
+  htable_destroy(common);
+}
+
+// Release the keys and values htable_replay() allocated
+void free_replayed(htable *tab)
+{
+  htable_itr itr = htable_iterator(tab);
+  htable_entry *entry = NULL;
+
+  while ((entry = htable_iterator_next(&itr)) != NULL) {
+    free((char *) entry->key);
+    free(entry->val);
+  }
+
+  htable_iterator_destroy(&itr);
+}
+
+void *drain_pipe(void *fd)
+{
+  char buf[4096];
+
+  while (read(*(int *) fd, buf, sizeof(buf)) > 0) {
+  }
+
+  return NULL;
+}
+
+void *read_replayed(void *table)
+{
+  for (int n = 0; n < 4; n++) {
+    for (int i = 0; i < 4096; i++) {
+      htable_get((htable *) table, keys[i]);
+    }
+  }
+
+  return NULL;
+}
+
+// Replaying removes while other threads read. Optimistic readers may still be comparing against a
+// removed key, so it has to outlive the replay
+void test_replay_readers(unsigned int flags)
+{
+  htable *tab = htable_create_with_flags(64, flags);
+  htable *copy = htable_create_with_flags(64, flags);
+  FILE *snapshot_file = tmpfile();
+  FILE *log_file = tmpfile();
+  pthread_t readers[2];
+
+  assert(tab != NULL && copy != NULL && snapshot_file != NULL && log_file != NULL);
+
+  for (int i = 0; i < 4096; i++) {
+    htable_set(tab, keys[i], "value");
+  }
+
+  assert(htable_snapshot(tab, fileno(snapshot_file), NULL) == 0);
+  assert(htable_log_start(tab, fileno(log_file), 1 << 20, NULL) == 0);
+
+  for (int i = 0; i < 4096; i++) {
+    htable_remove(tab, keys[i]);
+  }
+
+  assert(htable_log_stop(tab) == 0);
+
+  lseek(fileno(snapshot_file), 0, SEEK_SET);
+  lseek(fileno(log_file), 0, SEEK_SET);
+  assert(htable_replay(copy, fileno(snapshot_file), NULL) == 4096);
+
+  pthread_create(&readers[0], NULL, read_replayed, (void *) copy);
+  pthread_create(&readers[1], NULL, read_replayed, (void *) copy);
+
+  assert(htable_replay(copy, fileno(log_file), NULL) == 4096);
+
+  pthread_join(readers[0], NULL);
+  pthread_join(readers[1], NULL);
+
+  assert(htable_size(copy) == 0);
+
+  htable_destroy(tab);
+  htable_destroy(copy);
+
+  fclose(snapshot_file);
+  fclose(log_file);
+}
+
+// Append a record header followed by 'len' bytes of 'x'
+void write_raw_record(FILE *file, char op, uint32_t key_len, uint32_t val_len, size_t len)
+{
+  fputc(op, file);
+  fwrite(&key_len, sizeof(key_len), 1, file);
+  fwrite(&val_len, sizeof(val_len), 1, file);
+
+  for (size_t i = 0; i < len; i++) {
+    fputc('x', file);
+  }
+}
+
+// Replay a stream of raw records into 'tab'
+long replay_raw(htable *tab, FILE *file)
+{
+  fflush(file);
+  lseek(fileno(file), 0, SEEK_SET);
+
+  long records = htable_replay(tab, fileno(file), NULL);
+
+  fclose(file);
+
+  return records;
+}
+
+// Replaying records which no writer produces fails without touching the table any further
+void test_replay_corrupt(unsigned int flags)
+{
+  htable *tab = htable_create_with_flags(64, flags);
+  FILE *file;
+
+  assert(tab != NULL);
+
+  file = tmpfile();
+  write_raw_record(file, 'S', UINT32_MAX, 0, 256);
+  assert(replay_raw(tab, file) == -1);
+
+  file = tmpfile();
+  write_raw_record(file, 'S', 1, UINT32_MAX, 256);
+  assert(replay_raw(tab, file) == -1);
+
+  assert(htable_size(tab) == 0);
+
+  // Sets "x" to "x", then an unknown operation on it
+  file = tmpfile();
+  write_raw_record(file, 'S', 1, 1, 2);
+  write_raw_record(file, 'Z', 1, 0, 1);
+  assert(replay_raw(tab, file) == -1);
+
+  assert(strcmp(htable_get(tab, "x"), "x") == 0);
+
+  free_replayed(tab);
+  htable_destroy(tab);
+}
+
+// Nobody reads the pipe until the end, so the flusher blocks once it's full. Writers drop records instead
+// of waiting for it, and readers and writers on other threads carry on
+void test_log_overflow(unsigned int flags)
+{
+  htable *tab = htable_create_with_flags(64, flags);
+  char big[6000];
+  int fds[2];
+  pthread_t drain, reader;
+
+  assert(tab != NULL && pipe(fds) == 0);
+
+  memset(big, 'x', sizeof(big) - 1);
+  big[sizeof(big) - 1] = 0;
+
+  for (int i = 0; i < 4096; i++) {
+    htable_set(tab, keys[i], values[i]);
+  }
+
+  assert(htable_log_start(tab, fds[1], 0, NULL) == 0);
+
+  for (int n = 0; n < 32; n++) {
+    for (int i = 0; i < 4096; i++) {
+      htable_set(tab, keys[i], values[i]);
+    }
+  }
+
+  size_t dropped = htable_log_dropped(tab);
+
+  assert(dropped > 0);
+
+  // Dropping goes on until the log is stopped
+  htable_set(tab, keys[0], values[0]);
+  assert(htable_log_dropped(tab) == dropped + 1);
+
+  pthread_create(&reader, NULL, read_table_async, (void *) tab);
+  pthread_join(reader, NULL);
+
+  pthread_create(&drain, NULL, drain_pipe, (void *) &fds[0]);
+  assert(htable_log_flush(tab) == -1 && errno == ENOBUFS);
+  assert(htable_log_stop(tab) == -1 && errno == ENOBUFS);
+  assert(htable_log_dropped(tab) == 0 && htable_log_flush(tab) == 0);
+  close(fds[1]);
+  pthread_join(drain, NULL);
+  close(fds[0]);
+
+  // A record larger than the ring is dropped too
+  FILE *log_file = tmpfile();
+  assert(log_file != NULL);
+  assert(htable_log_start(tab, fileno(log_file), 0, NULL) == 0);
+  htable_set(tab, "key 4", big);
+  assert(htable_log_stop(tab) == -1 && errno == ENOBUFS);
+  assert(lseek(fileno(log_file), 0, SEEK_END) == 0);
+  fclose(log_file);
+
+  htable_remove(tab, "key 4");
+  htable_destroy(tab);
+}
+
+void test_log(unsigned int flags)
+{
+  htable *tab = htable_create_with_flags(64, flags);
+  FILE *log_file = tmpfile();
+  FILE *snapshot_file = tmpfile();
+  char big[6000];
+
+  assert(tab != NULL && log_file != NULL && snapshot_file != NULL);
+
+  memset(big, 'x', sizeof(big) - 1);
+  big[sizeof(big) - 1] = 0;
+
+  htable_set(tab, "key 1", "value 1");
+  htable_set(tab, "key 2", "value 2");
+  htable_set(tab, "key 3", "value 3");
+
+  // Log first, then snapshot, so the two together cover every change
+  assert(htable_log_start(tab, fileno(log_file), 1 << 13, NULL) == 0);
+  assert(htable_log_start(tab, fileno(log_file), 1 << 13, NULL) == -1);
+  assert(htable_snapshot(tab, fileno(snapshot_file), NULL) == 0);
+
+  htable_set(tab, "key 1", "value 1b");
+  htable_remove(tab, "key 2");
+  htable_set(tab, "key 4", big);
+  htable_set_async(tab, "key 5", "value 5");
+  htable_remove_async(tab, "key 3");
+  htable_flush(tab);
+
+  // Enough records to wrap around the ring several times
+  for (int i = 0; i < 4096; i++) {
+    htable_set(tab, keys[i], "value");
+    if (i % 128 == 0) {
+      assert(htable_log_flush(tab) == 0);
+    }
+  }
+  for (int i = 0; i < 4096; i += 2) {
+    htable_remove(tab, keys[i]);
+    if (i % 256 == 0) {
+      assert(htable_log_flush(tab) == 0);
+    }
+  }
+
+  assert(htable_log_stop(tab) == 0);
+
+  // Rebuild from snapshot + log
+  htable *copy = htable_create_with_flags(64, flags);
+  assert(copy != NULL);
+
+  lseek(fileno(snapshot_file), 0, SEEK_SET);
+  lseek(fileno(log_file), 0, SEEK_SET);
+
+  assert(htable_replay(copy, fileno(snapshot_file), NULL) == 3);
+  assert(htable_replay(copy, fileno(log_file), NULL) == 5 + 4096 + 2048);
+
+  assert(htable_size(copy) == htable_size(tab));
+  assert(htable_get(copy, "key 2") == NULL);
+  assert(htable_get(copy, "key 3") == NULL);
+  assert(strcmp(htable_get(copy, "key 4"), big) == 0);
+
+  htable_itr itr = htable_iterator(tab);
+  htable_entry *entry = NULL;
+
+  while ((entry = htable_iterator_next(&itr)) != NULL) {
+    assert(strcmp(htable_get(copy, entry->key), entry->val) == 0);
+  }
+
+  htable_iterator_destroy(&itr);
+
+  free_replayed(copy);
+  htable_destroy(copy);
+  htable_destroy(tab);
+
+  fclose(log_file);
+  fclose(snapshot_file);
+
+  test_replay_corrupt(flags);
+  test_replay_readers(flags);
+
+  test_log_overflow(flags);
+}
+
+void test_thread_cache(unsigned int flags)
+{
+  htable *tab = htable_create_with_flags(64, flags | HTABLE_THREAD_CACHE);
+  htable *other = htable_create_with_flags(64, flags | HTABLE_THREAD_CACHE);
+  htable_cache_stats before, after;
+
+  assert(tab != NULL && other != NULL);
+
+  htable_set(tab, "key 1", value_1);
+  htable_set(tab, "key 2", value_2);
+
+  // Only keys found are cached
+  before = htable_thread_cache_stats();
+  assert(htable_get(tab, "key 1") == value_1);
+  assert(htable_get(tab, "key 1") == value_1);
+  assert(htable_get(tab, "key 1") == value_1);
+  assert(htable_get(tab, "invalid key") == NULL);
+  assert(htable_get(tab, "invalid key") == NULL);
+  after = htable_thread_cache_stats();
+
+  assert(after.hits - before.hits == 2);
+  assert(after.misses - before.misses == 3);
+
+  // Every kind of write invalidates cached entries
+  htable_set(tab, "key 1", value_3);
+  assert(htable_get(tab, "key 1") == value_3);
+
+  htable_remove(tab, "key 1");
+  assert(htable_get(tab, "key 1") == NULL);
+
+  htable_set(tab, "key 1", value_1);
+  assert(htable_get(tab, "key 1") == value_1);
+  htable_resize(tab, 128);
+  assert(htable_get(tab, "key 1") == value_1);
+
+  htable_set_async(tab, "key 1", value_4);
+  htable_flush(tab);
+  assert(htable_get(tab, "key 1") == value_4);
+
+  // Long keys are never read through the cache, so they only hit through the table's own pointer
+  const char *long_key = "a key too long to be copied";
+  char long_copy[32];
+
+  strcpy(long_copy, long_key);
+  htable_set(tab, long_key, value_6);
+
+  before = htable_thread_cache_stats();
+  assert(htable_get(tab, long_copy) == value_6);
+  assert(htable_get(tab, long_copy) == value_6);
+  assert(htable_get(tab, long_key) == value_6);
+  assert(htable_get(tab, long_key) == value_6);
+  after = htable_thread_cache_stats();
+
+  assert(after.hits - before.hits == 2);
+  assert(after.misses - before.misses == 2);
+
+  // Short ones hit through any pointer
+  char short_copy[8];
+
+  strcpy(short_copy, "key 1");
+  assert(htable_get(tab, short_copy) == value_4);
+  before = htable_thread_cache_stats();
+  assert(htable_get(tab, "key 1") == value_4);
+  after = htable_thread_cache_stats();
+
+  assert(after.hits - before.hits == 1);
+
+  // Entries of different tables don't mix, even for the same key
+  htable_set(other, "key 1", value_5);
+  assert(htable_get(other, "key 1") == value_5);
+  assert(htable_get(tab, "key 1") == value_4);
+  assert(htable_get(other, "key 1") == value_5);
+
+  htable_destroy(tab);
+  htable_destroy(other);
+}
+
+int allocs_left = -1;
+
+// calloc, which fails once allocs_left runs out. Negative means unlimited
+void *limited_alloc(size_t count, size_t size)
+{
+  if (allocs_left == 0) {
+    return NULL;
+  }
+
+  if (allocs_left > 0) {
+    allocs_left--;
+  }
+
+  return calloc(count, size);
+}
+
+// Resizing and folding an inline table must not lose entries when overflow nodes can't be allocated
+void test_inline_out_of_memory(unsigned int flags)
+{
+  htable *tab = htable_create_with_flags(64, flags | HTABLE_INLINE_BUCKETS);
+
+  tab->alloc = limited_alloc;
+
+  for (int i = 0; i < 64; i++) {
+    htable_set(tab, keys[i], values[i]);
+  }
+
+  // Enough for the new array and the counts, not for the overflow nodes of 64 entries in 4 buckets
+  allocs_left = 2;
+  htable_resize(tab, 4);
+  assert(tab->cap == 64);
+
+  for (int i = 0; i < 64; i++) {
+    assert(htable_get(tab, keys[i]) == values[i]);
+  }
+
+  for (int i = 8; i < 64; i++) {
+    htable_remove(tab, keys[i]);
+  }
+
+  allocs_left = 0;
+  for (int i = 0; i < 64 && htable_compact(tab, 64); i++);
+
+  for (int i = 0; i < 8; i++) {
+    assert(htable_get(tab, keys[i]) == values[i]);
+  }
+
+  allocs_left = -1;
+  while (htable_compact(tab, 64));
+  assert(tab->cap == 8);
+
+  htable_resize(tab, 2);
+  assert(tab->cap == 2);
+
+  for (int i = 0; i < 64; i++) {
+    assert(htable_get(tab, keys[i]) == (i < 8 ? values[i] : NULL));
+  }
+
+  htable_destroy(tab);
+}
+
+// Check that each of the first 'count' keys is in exactly one of the tables
+void check_split(htable *a, htable *b, int count)
+{
+  assert(htable_size(a) + htable_size(b) == count);
+
+  for (int i = 0; i < count; i++) {
+    assert((htable_get(a, keys[i]) == values[i]) != (htable_get(b, keys[i]) == values[i]));
+  }
+}
+
+// Set operations which run out of nodes must not lose entries
+void test_setop_out_of_memory(unsigned int flags)
+{
+  htable *src = htable_create_with_flags(64, flags);
+  htable *dst = htable_create_with_flags(32, flags);
+  htable *empty = htable_create_with_flags(64, flags);
+
+  src->alloc = limited_alloc;
+  dst->alloc = limited_alloc;
+
+  for (int i = 0; i < 16; i++) {
+    htable_set(src, keys[i], values[i]);
+  }
+
+  // Merging entry by entry moves nothing unless there's a node for every key missing from dst
+  allocs_left = 3;
+  assert(htable_merge(dst, src, NULL, 1) == -1);
+  assert(htable_size(dst) == 0);
+  check_split(dst, src, 16);
+
+  allocs_left = -1;
+  assert(htable_merge(dst, src, NULL, 1) == 0);
+  assert(htable_size(src) == 0);
+  check_split(dst, src, 16);
+
+  // A result missing entries is never handed out
+  for (int n = 0; n < 24; n++) {
+    allocs_left = n;
+    htable *diff = htable_diff(dst, empty, 1);
+    allocs_left = -1;
+
+    if (diff != NULL) {
+      assert(htable_size(diff) == 16);
+      htable_destroy(diff);
+    }
+  }
+
+  htable_destroy(src);
+  htable_destroy(dst);
+
+  // Bucket-wise, inline slot entries of src need a node once dst's slots are full. Those stay in src
+  if (flags & HTABLE_INLINE_BUCKETS) {
+    src = htable_create_with_flags(1, flags);
+    dst = htable_create_with_flags(1, flags);
+
+    src->alloc = limited_alloc;
+    dst->alloc = limited_alloc;
+
+    for (int i = 0; i < 19; i++) {
+      htable_set(i < 16 ? src : dst, keys[i], values[i]);
+    }
+
+    allocs_left = 0;
+    assert(htable_merge(dst, src, NULL, 1) == -1);
+    assert(htable_size(src) == HTABLE_BUCKET_SLOTS);
+    check_split(dst, src, 19);
+
+    allocs_left = -1;
+    assert(htable_merge(dst, src, NULL, 1) == 0);
+    assert(htable_size(src) == 0);
+    check_split(dst, src, 19);
+
+    htable_destroy(src);
+    htable_destroy(dst);
+  }
+
+  htable_destroy(empty);
+}
+
+// Check that every 16th key is in the table and nothing else
+void check_compacted(htable *tab)
+{
+  htable_itr itr = htable_iterator(tab);
+  int count = 0;
+
+  while (htable_iterator_next(&itr) != NULL) {
+    count++;
+  }
+
+  htable_iterator_destroy(&itr);
+
+  assert(count == 256);
+  assert(htable_size(tab) == 256);
+
+  for (int i = 0; i < 4096; i++) {
+    assert(htable_get(tab, keys[i]) == (i % 16 == 0 ? values[i] : NULL));
+  }
+}
+
+void test_compact(unsigned int flags)
+{
+  htable *tab = htable_create_with_flags(4096, flags);
+  htable *other = htable_create_with_flags(64, flags);
+  pthread_t readers[2];
+  int steps = 0;
+
+  // A delete wave leaves every 16th key
+  for (int i = 0; i < 4096; i++) {
+    htable_set(tab, keys[i], values[i]);
+  }
+
+  for (int i = 0; i < 4096; i++) {
+    if (i % 16 != 0) {
+      htable_remove(tab, keys[i]);
+    }
+  }
+
+  size_t before = htable_memory(tab);
+
+  // The table stays usable between steps
+  while (htable_compact(tab, 64)) {
+    int i = steps * 16 % 4096;
+
+    assert(htable_get(tab, keys[i]) == values[i]);
+    assert(htable_get(tab, keys[i + 1]) == NULL);
+    assert(htable_remove(tab, keys[i]) == values[i]);
+    htable_set(tab, keys[i], values[i]);
+
+    steps++;
+  }
+
+  assert(steps > 16);
+  assert(tab->cap == 256);
+  check_compacted(tab);
+
+  // Optimistic tables keep the old array for readers which may still be on it
+  if (!(flags & HTABLE_OPTIMISTIC)) {
+    assert(htable_memory(tab) < before);
+  }
+
+  // Nothing to do until the table is written again
+  assert(htable_compact(tab, 64) == 0);
+
+  // Overwriting and adding a few entries doesn't copy the nodes again
+  htable_arena *arena = tab->arenas;
+
+  htable_set(tab, keys[0], values[0]);
+  htable_set(tab, keys[1], values[1]);
+  assert(htable_compact(tab, 64) == 0);
+  assert(tab->arenas == arena);
+  assert(htable_remove(tab, keys[1]) == values[1]);
+
+  // Resizing cancels a running compaction
+  htable_resize(tab, 4096);
+  assert(htable_compact(tab, 16) == 1);
+  htable_resize(tab, 2048);
+  check_compacted(tab);
+
+  // Compacting while other threads read
+  pthread_create(&readers[0], NULL, read_table_async, (void *) tab);
+  pthread_create(&readers[1], NULL, read_table_async, (void *) tab);
+
+  while (htable_compact(tab, 8));
+
+  pthread_join(readers[0], NULL);
+  pthread_join(readers[1], NULL);
+
+  assert(tab->cap == 256);
+  check_compacted(tab);
+
+  // Relocated entries can still be merged away, and compacting an empty table shrinks it to one bucket
+  htable_merge(other, tab, NULL, 2);
+  check_compacted(other);
+  assert(htable_size(tab) == 0);
+
+  // A step is done even without a budget
+  while (htable_compact(tab, 0));
+  assert(tab->cap == 1);
+
+  htable_destroy(tab);
+  htable_destroy(other);
+}
+
+void test_table(unsigned int flags)
 {
   // Test create htable
-  htable *tab_small = htable_create(4);
+  htable *tab_small = htable_create_with_flags(4, flags);
   assert(tab_small != NULL);
 
-  htable *tab_large = htable_create(2048);
+  htable *tab_large = htable_create_with_flags(2048, flags);
   assert(tab_large != NULL);
 
   printf("htable_create pass\n");
 
-  // Initialize values
-  value_1 = malloc(sizeof(int));
-  *value_1 = 1;
-  value_2 = malloc(sizeof(int));
-  *value_2 = 2;
-  value_3 = malloc(sizeof(int));
-  *value_3 = 3;
-  value_4 = malloc(sizeof(int));
-  *value_4 = 4;
-  value_5 = malloc(sizeof(int));
-  *value_5 = 5;
-  value_6 = malloc(sizeof(int));
-  *value_6 = 6;
-  value_7 = malloc(sizeof(int));
-  *value_7 = 7;
-  value_8 = malloc(sizeof(int));
-  *value_8 = 8;
-
   // Set values
   htable_set(tab_small, "key 1", value_1);
   assert(*(int *) htable_get(tab_small, "key 1") == *value_1);
@@ -230,14 +982,17 @@ int main()
   // Test iterator
   htable_entry *entry = NULL;
   htable_itr itr = htable_iterator(tab_small);
+  int count = 0;
 
   while ((entry = htable_iterator_next(&itr)) != NULL) {
     // Just test that the entry has some values
     assert(entry->key != NULL);
     assert(entry->val != NULL);
+    count++;
   }
 
   htable_iterator_destroy(&itr);
+  assert(count == 8);
 
   printf("htable_iterator: pass\n");
 
@@ -342,7 +1097,7 @@ int main()
   assert(*(int *) htable_get(tab_small, "key 4") == *value_4);
   assert(htable_size(tab_small) == 4);
 
-  pthread_t writer, reader, thread1, thread2;
+  pthread_t writer, reader, thread1, thread2, thread3;
 
   printf("testing concurrent read/write...\n");
 
@@ -355,7 +1110,8 @@ int main()
   printf("htable_concurrent read/write: pass\n");
 
   // Test random read/write. Key & value should always match
-  init_values(keys, values);
+  reads_large = 0;
+  writes_large = 0;
 
   printf("testing larger table concurrent read/write...\n");
 
@@ -363,18 +1119,147 @@ int main()
   pthread_create(&reader, NULL, read_table_large, (void *) tab_large);
   pthread_create(&thread1, NULL, read_write_remove_large, (void *) tab_large);
   pthread_create(&thread2, NULL, read_write_remove_large, (void *) tab_large);
+  pthread_create(&thread3, NULL, remove_resize_large, (void *) tab_large);
 
   pthread_join(writer, NULL);
   pthread_join(reader, NULL);
   pthread_join(thread1, NULL);
   pthread_join(thread2, NULL);
+  pthread_join(thread3, NULL);
 
   printf("larger table concurrency: pass. Reads: ~%i, Writes: ~%i \n", reads_large, writes_large);
 
+  // Queued writes from several threads, applied by whichever thread gets the lock
+  htable *tab_async = htable_create_with_flags(1024, flags);
+  assert(tab_async != NULL);
+
+  printf("testing async writes...\n");
+
+  pthread_create(&writer, NULL, write_table_async, (void *) tab_async);
+  pthread_create(&thread1, NULL, write_table_async, (void *) tab_async);
+  pthread_create(&thread2, NULL, write_table_async, (void *) tab_async);
+  pthread_create(&reader, NULL, read_table_async, (void *) tab_async);
+
+  pthread_join(writer, NULL);
+  pthread_join(thread1, NULL);
+  pthread_join(thread2, NULL);
+  pthread_join(reader, NULL);
+
+  htable_flush(tab_async);
+  assert(htable_size(tab_async) == 4096);
+  for (int i = 0; i < 4096; i++) {
+    assert(htable_get(tab_async, keys[i]) == values[i]);
+  }
+
+  pthread_create(&writer, NULL, remove_table_async, (void *) tab_async);
+  pthread_create(&thread1, NULL, remove_table_async, (void *) tab_async);
+
+  pthread_join(writer, NULL);
+  pthread_join(thread1, NULL);
+
+  htable_flush(tab_async);
+  assert(htable_size(tab_async) == 0);
+  assert(htable_get(tab_async, keys[0]) == NULL);
+
+  // A direct write always lands after the caller's queued ones
+  htable_set_async(tab_async, "key 1", value_1);
+  htable_set(tab_async, "key 1", value_2);
+  assert(htable_get(tab_async, "key 1") == value_2);
+
+  htable_remove_async(tab_async, "key 1");
+  htable_flush(tab_async);
+  assert(htable_get(tab_async, "key 1") == NULL);
+
+  // Operations queued while another thread holds the table are applied when it lets go, without a flush
+  htable_itr itr_async = htable_iterator(tab_async);
+  pthread_create(&writer, NULL, set_async_value_3, (void *) tab_async);
+  pthread_join(writer, NULL);
+  htable_iterator_destroy(&itr_async);
+  assert(htable_get(tab_async, "key 1") == value_3);
+
+  itr_async = htable_iterator_mut(tab_async);
+  pthread_create(&writer, NULL, remove_async_key_1, (void *) tab_async);
+  pthread_join(writer, NULL);
+  htable_iterator_destroy(&itr_async);
+  assert(htable_get(tab_async, "key 1") == NULL);
+
+  htable_destroy(tab_async);
+
+  printf("htable_set_async/htable_remove_async: pass\n");
+
+  // Bucket-wise on one and several threads, then entry by entry for tables of different sizes
+  test_set_operations(flags, 1024, 1);
+  test_set_operations(flags, 1024, 4);
+  test_set_operations(flags, 512, 4);
+  test_merge_readers(flags);
+
+  printf("htable_merge/htable_diff/htable_intersect: pass\n");
+
+  test_log(flags);
+
+  printf("htable_log/htable_snapshot/htable_replay: pass\n");
+
+  test_thread_cache(flags);
+
+  printf("htable_thread_cache: pass\n");
+
+  test_compact(flags);
+
+  printf("htable_compact: pass\n");
+
+  if (flags & HTABLE_INLINE_BUCKETS) {
+    test_inline_out_of_memory(flags);
+
+    printf("inline buckets out of memory: pass\n");
+  }
+
+  test_setop_out_of_memory(flags);
+
+  printf("set operations out of memory: pass\n");
+
   // Test destroy table
   htable_destroy(tab_small);
   htable_destroy(tab_large);
   printf("htable_destroy: pass\n");
+}
+
+
+int main()
+{
+  // Initialize values
+  value_1 = malloc(sizeof(int));
+  *value_1 = 1;
+  value_2 = malloc(sizeof(int));
+  *value_2 = 2;
+  value_3 = malloc(sizeof(int));
+  *value_3 = 3;
+  value_4 = malloc(sizeof(int));
+  *value_4 = 4;
+  value_5 = malloc(sizeof(int));
+  *value_5 = 5;
+  value_6 = malloc(sizeof(int));
+  *value_6 = 6;
+  value_7 = malloc(sizeof(int));
+  *value_7 = 7;
+  value_8 = malloc(sizeof(int));
+  *value_8 = 8;
+
+  init_values(keys, values);
+
+  printf("testing default table...\n");
+  test_table(0);
+
+  printf("testing optimistic table...\n");
+  test_table(HTABLE_OPTIMISTIC);
+
+  printf("testing inline bucket table...\n");
+  test_table(HTABLE_INLINE_BUCKETS);
+
+  printf("testing optimistic inline bucket table...\n");
+  test_table(HTABLE_INLINE_BUCKETS | HTABLE_OPTIMISTIC);
+
+  printf("testing thread cache table...\n");
+  test_table(HTABLE_THREAD_CACHE);
 
   // Free test resources
   free(value_1);